@@ -1,7 +1,13 @@
 #include "bvh.h"
 #include "math.h"
 #include "util.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <thread>
+#include <utility>
 
 void BVH_Volume::expand(const Vec3 &point) {
     max = v_max(max, point);
@@ -9,107 +15,117 @@ void BVH_Volume::expand(const Vec3 &point) {
     centre = (max + min) / 2;
 }
 
-const float BVH_Volume::heuristic_intersect(const Ray &ray) const {
-    float tmin = (min.x - ray.origin.x) * ray.inv_dir.x;
-    float tmax = (max.x - ray.origin.x) * ray.inv_dir.x;
-
-    if (tmin > tmax) {
-        float temp = tmin;
-        tmin = tmax;
-        tmax = temp;
-    }
+void BVH_Volume::expand(const BVH_Volume &other) {
+    max = v_max(max, other.max);
+    min = v_min(min, other.min);
+    centre = (max + min) / 2;
+}
 
-    float tymin = (min.y - ray.origin.y) * ray.inv_dir.y;
-    float tymax = (max.y - ray.origin.y) * ray.inv_dir.y;
+float BVH_Volume::surface_area() const {
+    Vec3 d = max - min;
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+        return 0;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
 
-    if (tymin > tymax) {
-        float temp = tymin;
-        tymin = tymax;
-        tymax = temp;
-    }
+static inline float axis_of(const Vec3 &v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
 
-    if ((tmin > tymax) || (tymin > tmax))
-        return -1;
+/*************************************
+ * Nodes with fewer primitives are split on the thread that reached them,
+ * smaller subtrees finish before a new thread would have started
+ *************************************/
+constexpr size_t BUILD_TASK_MIN_PRIMITIVES = 4096;
 
-    if (tymin > tmin)
-        tmin = tymin;
-    if (tymax < tmax)
-        tmax = tymax;
+/*************************************
+ * Primitives per slice when a single node is binned and partitioned by
+ * several threads, only the top levels of large meshes get that far
+ *************************************/
+constexpr size_t BUILD_SLICE_MIN_PRIMITIVES = 1 << 16;
 
-    float tzmin = (min.z - ray.origin.z) * ray.inv_dir.z;
-    float tzmax = (max.z - ray.origin.z) * ray.inv_dir.z;
+/***********************************
+ * Threads a BVH build may still start
+ * Shared by every task of one build so the whole build never runs more
+ * threads than it was given.
+ ***********************************/
+struct BuildThreads {
+    std::atomic<int> spare;
 
-    if (tzmin > tzmax) {
-        float temp = tzmin;
-        tzmin = tzmax;
-        tzmax = temp;
+    explicit BuildThreads(unsigned int num_threads) {
+        if (!num_threads)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        spare = int(num_threads) - 1;
     }
 
-    if ((tmin > tzmax) || (tzmin > tmax))
-        return -1;
-
-    if (tzmin > tmin)
-        tmin = tzmin;
-    return tmin;
-}
-
-const bool BVH_Volume::intersect(const Ray &ray) const {
-    float tmin = (min.x - ray.origin.x) * ray.inv_dir.x;
-    float tmax = (max.x - ray.origin.x) * ray.inv_dir.x;
-
-    if (tmin > tmax) {
-        float temp = tmin;
-        tmin = tmax;
-        tmax = temp;
+    /***************************************************
+     * @brief Takes up to wanted threads
+     * @return Number of threads taken, to be given back with release
+     ***************************************************/
+    int acquire(int wanted) {
+        int available = spare.load();
+        while (wanted > 0 && available > 0) {
+            int taken = std::min(wanted, available);
+            if (spare.compare_exchange_weak(available, available - taken))
+                return taken;
+        }
+        return 0;
     }
 
-    float tymin = (min.y - ray.origin.y) * ray.inv_dir.y;
-    float tymax = (max.y - ray.origin.y) * ray.inv_dir.y;
+    void release(int count) { spare += count; }
+};
 
-    if (tymin > tymax) {
-        float temp = tymin;
-        tymin = tymax;
-        tymax = temp;
+/***************************************************
+ * @brief Splits child A on a spare thread while child B is split on this
+ * one, or both here if the node is small or no thread is spare
+ ***************************************************/
+template <typename F>
+static void split_children(BVH_Node &node, size_t size, BuildThreads &threads,
+                           F split_child) {
+    if (size >= BUILD_TASK_MIN_PRIMITIVES && threads.acquire(1)) {
+        std::thread task([&]() {
+            split_child(node.childA);
+            threads.release(1);
+        });
+        split_child(node.childB);
+        task.join();
+        return;
     }
+    split_child(node.childA);
+    split_child(node.childB);
+}
 
-    if ((tmin > tymax) || (tymin > tmax))
-        return false;
-
-    if (tymin > tmin)
-        tmin = tymin;
-    if (tymax < tmax)
-        tmax = tymax;
-
-    float tzmin = (min.z - ray.origin.z) * ray.inv_dir.z;
-    float tzmax = (max.z - ray.origin.z) * ray.inv_dir.z;
-
-    if (tzmin > tzmax) {
-        float temp = tzmin;
-        tzmin = tzmax;
-        tzmax = temp;
+/***************************************************
+ * @brief Cuts [0, count) into one slice per thread and runs
+ * fn(slice, first, last) on each, the last slice on this thread
+ ***************************************************/
+template <typename F>
+static void run_slices(int slices, size_t count, F fn) {
+    std::vector<std::thread> workers;
+    workers.reserve(slices - 1);
+    for (int s = 0; s < slices; s++) {
+        size_t first = count * s / slices, last = count * (s + 1) / slices;
+        if (s == slices - 1)
+            fn(s, first, last);
+        else
+            workers.emplace_back(fn, s, first, last);
     }
-
-    if ((tmin > tzmax) || (tzmin > tmax))
-        return false;
-    if (tzmin > tmin)
-        tmin = tzmin;
-    return tmin > 0;
+    for (std::thread &worker : workers)
+        worker.join();
 }
 
-void split(std::unique_ptr<BVH_Node> &root, int max_depth) {
+static void split(std::unique_ptr<BVH_Node> &root, int max_depth,
+                  const BVH &mesh, BuildThreads &threads) {
 
     if (!max_depth)
         return;
     std::unique_ptr<BVH_Node> childA = std::make_unique<BVH_Node>();
     std::unique_ptr<BVH_Node> childB = std::make_unique<BVH_Node>();
 
-    int N = root->triangles.size();
-
     Vec3 side_lengths = root->volume.max - root->volume.min;
     int longest = 0;
 
     // Find longest side and split it
-    // TODO: Try surface area heuristic for splitting
     if (side_lengths.x > side_lengths.y) {
         if (side_lengths.z > side_lengths.x)
             longest = 2;
@@ -122,54 +138,621 @@ void split(std::unique_ptr<BVH_Node> &root, int max_depth) {
             longest = 1;
     }
 
-    for (int i = 0; i < N; i++) {
-        float w1, w2;
+    for (uint32_t index : root->primitives) {
+        BVH_Volume triangle = mesh.triangle_bounds(index);
+        const Vec3 &v1 = mesh.vertex(index, 0), &v2 = mesh.vertex(index, 1),
+                   &v3 = mesh.vertex(index, 2);
+        float h = ((v1 - v2).length() + (v2 - v3).length() +
+                   (v1 - v3).length()) /
+                  3;
+        float w1 = axis_of(triangle.centre, longest);
+        float w2 = axis_of(root->volume.centre, longest);
 
-        switch (longest) {
-        case 0: {
-            w1 = root->triangles[i]->centre.x;
-            w2 = root->volume.centre.x;
-            break;
-        }
-        case 1: {
-            w1 = root->triangles[i]->centre.y;
-            w2 = root->volume.centre.y;
-            break;
-        }
-        case 2: {
-            w1 = root->triangles[i]->centre.z;
-            w2 = root->volume.centre.z;
-            break;
-        }
-        };
         // c1 is strict side check, c2 is hand wavey heuristic check
         // to see if triangle is part of both sides of split
         bool c1 = w1 < w2;
-        bool c2 = abs(w1 - w2) < root->triangles[i]->h;
-
-        if (c2) {
-            // If both sides copy triangle and give to both children
-            std::unique_ptr<Triangle> copy_tr =
-                std::make_unique<Triangle>(*root->triangles[i]);
-            childA->volume.expand(root->triangles[i]->max);
-            childA->volume.expand(root->triangles[i]->min);
-            childA->triangles.push_back(std::move(root->triangles[i]));
-            childB->volume.expand(copy_tr->min);
-            childB->volume.expand(copy_tr->max);
-            childB->triangles.push_back(std::move(copy_tr));
-        } else if (c1) {
-            childA->volume.expand(root->triangles[i]->max);
-            childA->volume.expand(root->triangles[i]->min);
-            childA->triangles.push_back(std::move(root->triangles[i]));
-        } else {
-            childB->volume.expand(root->triangles[i]->max);
-            childB->volume.expand(root->triangles[i]->min);
-            childB->triangles.push_back(std::move(root->triangles[i]));
+        bool c2 = std::fabs(w1 - w2) < h;
+
+        // Straddling triangles are referenced by both children, not copied
+        if (c2 || c1) {
+            childA->volume.expand(triangle.max);
+            childA->volume.expand(triangle.min);
+            childA->primitives.push_back(index);
+        }
+        if (c2 || !c1) {
+            childB->volume.expand(triangle.min);
+            childB->volume.expand(triangle.max);
+            childB->primitives.push_back(index);
         }
     }
 
+    // Splitting made no progress, keep the node as a leaf
+    size_t size = root->primitives.size();
+    if (childA->primitives.size() == size || childB->primitives.size() == size)
+        return;
+    root->primitives.clear();
+    root->primitives.shrink_to_fit();
+
     root->childA = std::move(childA);
     root->childB = std::move(childB);
-    split(root->childA, max_depth - 1);
-    split(root->childB, max_depth - 1);
+    split_children(*root, size, threads, [&](std::unique_ptr<BVH_Node> &child) {
+        split(child, max_depth - 1, mesh, threads);
+    });
+}
+
+void split(std::unique_ptr<BVH_Node> &root, int max_depth, const BVH &mesh,
+           unsigned int num_threads) {
+    BuildThreads threads(num_threads);
+    split(root, std::min(max_depth, BVH_MAX_DEPTH), mesh, threads);
+}
+
+/***************************************************
+ * SAH cost model, relative cost of a box test against a triangle test
+ ***************************************************/
+constexpr float SAH_TRAVERSAL_COST = 1.0f;
+constexpr float SAH_INTERSECT_COST = 2.0f;
+
+static void split_sah(std::unique_ptr<BVH_Node> &root,
+                      const std::vector<BVH_Volume> &bounds, int num_bins,
+                      int leaf_block, int depth, BuildThreads &threads) {
+    int N = root->primitives.size();
+    if (N <= std::max(2, leaf_block) || depth >= BVH_MAX_DEPTH)
+        return;
+
+    // Leaves pay for whole blocks of primitives
+    auto blocks = [leaf_block](int count) {
+        return float((count + leaf_block - 1) / leaf_block);
+    };
+
+    // Large nodes are binned and partitioned in slices on spare threads,
+    // slices are merged in order so the tree does not depend on the count
+    int helpers = threads.acquire(N / BUILD_SLICE_MIN_PRIMITIVES - 1);
+    int slices = helpers + 1;
+    const std::vector<uint32_t> &primitives = root->primitives;
+
+    std::vector<BVH_Volume> slice_centroids(slices);
+    run_slices(slices, N, [&](int s, size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            slice_centroids[s].expand(bounds[primitives[i]].centre);
+    });
+    BVH_Volume centroids;
+    for (const BVH_Volume &volume : slice_centroids)
+        centroids.expand(volume);
+
+    struct Bin {
+        BVH_Volume volume;
+        int count = 0;
+    };
+    float lo[3], scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        lo[axis] = axis_of(centroids.min, axis);
+        float extent = axis_of(centroids.max, axis) - lo[axis];
+        scale[axis] = extent > 0 ? num_bins / extent : 0;
+    }
+
+    // Each slice bins its own primitives along every axis
+    std::vector<Bin> slice_bins(size_t(slices) * 3 * num_bins);
+    run_slices(slices, N, [&](int s, size_t first, size_t last) {
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0)
+                continue;
+            float axis_lo = lo[axis], axis_scale = scale[axis];
+            Bin *axis_bins = &slice_bins[(size_t(s) * 3 + axis) * num_bins];
+            for (size_t i = first; i < last; i++) {
+                const BVH_Volume &volume = bounds[primitives[i]];
+                int b = std::min(
+                    num_bins - 1,
+                    int((axis_of(volume.centre, axis) - axis_lo) * axis_scale));
+                axis_bins[b].count++;
+                axis_bins[b].volume.expand(volume);
+            }
+        }
+    });
+
+    std::vector<Bin> bins(num_bins);
+    std::vector<float> right_area(num_bins);
+    std::vector<int> right_count(num_bins);
+
+    // Costs grow with the square of the mesh units, so TINGE_INFINITY is
+    // not a safe upper bound
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1, best_bin = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0)
+            continue;
+
+        const Bin *axis_bins = &slice_bins[size_t(axis) * num_bins];
+        if (slices > 1) {
+            std::fill(bins.begin(), bins.end(), Bin());
+            for (int s = 0; s < slices; s++)
+                for (int b = 0; b < num_bins; b++) {
+                    const Bin &bin =
+                        slice_bins[(size_t(s) * 3 + axis) * num_bins + b];
+                    bins[b].count += bin.count;
+                    bins[b].volume.expand(bin.volume);
+                }
+            axis_bins = bins.data();
+        }
+
+        // Sweep from the right to get the cost of everything past each plane
+        BVH_Volume right;
+        int count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right.expand(axis_bins[b].volume);
+            count += axis_bins[b].count;
+            right_area[b] = right.surface_area();
+            right_count[b] = count;
+        }
+
+        // Plane b lies between bins b - 1 and b
+        BVH_Volume left;
+        count = 0;
+        for (int b = 1; b < num_bins; b++) {
+            left.expand(axis_bins[b - 1].volume);
+            count += axis_bins[b - 1].count;
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            float cost = left.surface_area() * blocks(count) +
+                         right_area[b] * blocks(right_count[b]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    float area = root->volume.surface_area();
+    float split_cost =
+        SAH_TRAVERSAL_COST +
+        SAH_INTERSECT_COST * (area > 0 ? best_cost / area : blocks(N));
+    if (best_axis < 0 || split_cost >= SAH_INTERSECT_COST * blocks(N)) {
+        threads.release(helpers);
+        return;
+    }
+
+    // Slices partition into their own halves, joined in slice order
+    std::vector<BVH_Node> slice_children(size_t(slices) * 2);
+    run_slices(slices, N, [&](int s, size_t first, size_t last) {
+        BVH_Node &a = slice_children[2 * s], &b = slice_children[2 * s + 1];
+        float axis_lo = lo[best_axis], axis_scale = scale[best_axis];
+        for (size_t i = first; i < last; i++) {
+            uint32_t index = primitives[i];
+            int bin = std::min(
+                num_bins - 1,
+                int((axis_of(bounds[index].centre, best_axis) - axis_lo) *
+                    axis_scale));
+            BVH_Node &child = bin < best_bin ? a : b;
+            child.volume.expand(bounds[index]);
+            child.primitives.push_back(index);
+        }
+    });
+    threads.release(helpers);
+
+    std::unique_ptr<BVH_Node> childA = std::make_unique<BVH_Node>();
+    std::unique_ptr<BVH_Node> childB = std::make_unique<BVH_Node>();
+    if (slices == 1) {
+        *childA = std::move(slice_children[0]);
+        *childB = std::move(slice_children[1]);
+    } else
+        for (int s = 0; s < slices; s++)
+            for (int c = 0; c < 2; c++) {
+                BVH_Node &part = slice_children[2 * s + c];
+                BVH_Node &child = c ? *childB : *childA;
+                child.volume.expand(part.volume);
+                child.primitives.insert(child.primitives.end(),
+                                        part.primitives.begin(),
+                                        part.primitives.end());
+            }
+    root->primitives.clear();
+    root->primitives.shrink_to_fit();
+
+    root->childA = std::move(childA);
+    root->childB = std::move(childB);
+    split_children(*root, N, threads, [&](std::unique_ptr<BVH_Node> &child) {
+        split_sah(child, bounds, num_bins, leaf_block, depth + 1, threads);
+    });
+}
+
+void split_sah(std::unique_ptr<BVH_Node> &root,
+               const std::vector<BVH_Volume> &bounds, int num_bins,
+               int leaf_block, unsigned int num_threads) {
+    BuildThreads threads(num_threads);
+    split_sah(root, bounds, num_bins, leaf_block, 0, threads);
+}
+
+// Empty child slots hold a box at the end of the float range, which every
+// ray reaches beyond TINGE_INFINITY or behind its origin
+constexpr float BVH_EMPTY_BOUND = std::numeric_limits<float>::max();
+
+static void flatten_node(BVH_Node *node, std::vector<BVH_WideNode> &nodes,
+                         std::vector<uint32_t> &indices, int leaf_align) {
+    // Open the largest interior child until the node is full
+    std::vector<BVH_Node *> children;
+    if (node->childA == nullptr && node->childB == nullptr)
+        children.push_back(node);
+    else
+        children = {node->childA.get(), node->childB.get()};
+
+    while (children.size() < BVH_WIDTH) {
+        int largest = -1;
+        float largest_area = -1;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->childA == nullptr)
+                continue;
+            float area = children[i]->volume.surface_area();
+            if (area > largest_area) {
+                largest = int(i);
+                largest_area = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        BVH_Node *opened = children[largest];
+        children[largest] = opened->childA.get();
+        children.push_back(opened->childB.get());
+    }
+
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    for (int i = 0; i < BVH_WIDTH; i++) {
+        BVH_WideNode &wide = nodes[index];
+        wide.min_x[i] = wide.min_y[i] = wide.min_z[i] = BVH_EMPTY_BOUND;
+        wide.max_x[i] = wide.max_y[i] = wide.max_z[i] = BVH_EMPTY_BOUND;
+        wide.offset[i] = wide.count[i] = 0;
+    }
+
+    for (size_t i = 0; i < children.size(); i++) {
+        BVH_Node *child = children[i];
+        uint32_t offset, count = 0;
+        if (child->childA == nullptr) {
+            if (child->primitives.empty())
+                continue;
+            offset = indices.size();
+            count = child->primitives.size();
+            indices.insert(indices.end(), child->primitives.begin(),
+                           child->primitives.end());
+            while (indices.size() % leaf_align)
+                indices.push_back(child->primitives.back());
+            child->primitives.clear();
+        } else {
+            offset = nodes.size();
+            flatten_node(child, nodes, indices, leaf_align);
+        }
+
+        BVH_WideNode &wide = nodes[index];
+        wide.min_x[i] = child->volume.min.x;
+        wide.min_y[i] = child->volume.min.y;
+        wide.min_z[i] = child->volume.min.z;
+        wide.max_x[i] = child->volume.max.x;
+        wide.max_y[i] = child->volume.max.y;
+        wide.max_z[i] = child->volume.max.z;
+        wide.offset[i] = offset;
+        wide.count[i] = count;
+    }
+}
+
+void flatten(std::unique_ptr<BVH_Node> &root, std::vector<BVH_WideNode> &nodes,
+             std::vector<uint32_t> &indices, int leaf_align) {
+    nodes.clear();
+    indices.clear();
+    flatten_node(root.get(), nodes, indices, leaf_align);
+    root.reset();
+}
+
+Vec3 BVH::normal(uint32_t triangle) const {
+    const Vec3 &v1 = vertex(triangle, 0), &v2 = vertex(triangle, 1),
+               &v3 = vertex(triangle, 2);
+    return cross(v1 - v2, v2 - v3).normalized();
+}
+
+BVH_Volume BVH::triangle_bounds(uint32_t triangle) const {
+    const Vec3 &v1 = vertex(triangle, 0), &v2 = vertex(triangle, 1),
+               &v3 = vertex(triangle, 2);
+    BVH_Volume volume;
+    volume.min = v_min(v_min(v1, v2), v3);
+    volume.max = v_max(v_max(v1, v2), v3);
+    volume.centre = (v1 + v2 + v3) / 3;
+    return volume;
+}
+
+void BVH::flatten(std::unique_ptr<BVH_Node> &root) {
+    bounds = root->volume;
+    ::flatten(root, nodes, indices, TRIANGLE_BLOCK_SIZE);
+
+    // Transpose the referenced triangles into blocks in leaf order
+    blocks.resize(indices.size() / TRIANGLE_BLOCK_SIZE);
+    for (size_t i = 0; i < indices.size(); i++) {
+        const Vec3 &v1 = vertex(indices[i], 0);
+        Vec3 e1 = vertex(indices[i], 1) - v1, e2 = vertex(indices[i], 2) - v1;
+        TriangleBlock &block = blocks[i / TRIANGLE_BLOCK_SIZE];
+        int k = i % TRIANGLE_BLOCK_SIZE;
+        block.v1_x[k] = v1.x, block.v1_y[k] = v1.y, block.v1_z[k] = v1.z;
+        block.e1_x[k] = e1.x, block.e1_y[k] = e1.y, block.e1_z[k] = e1.z;
+        block.e2_x[k] = e2.x, block.e2_y[k] = e2.y, block.e2_z[k] = e2.z;
+    }
+
+    // Padding after each leaf becomes degenerate so it is never hit
+    for (const BVH_WideNode &node : nodes)
+        for (int c = 0; c < BVH_WIDTH; c++) {
+            if (!node.count[c])
+                continue;
+            for (uint32_t i = node.offset[c] + node.count[c];
+                 i % TRIANGLE_BLOCK_SIZE; i++) {
+                TriangleBlock &block = blocks[i / TRIANGLE_BLOCK_SIZE];
+                int k = i % TRIANGLE_BLOCK_SIZE;
+                block.e1_x[k] = block.e1_y[k] = block.e1_z[k] = 0;
+                block.e2_x[k] = block.e2_y[k] = block.e2_z[k] = 0;
+            }
+        }
+}
+
+float BVH::duplication_factor() const {
+    if (triangles.empty())
+        return 0;
+    size_t references = 0;
+    for (const BVH_WideNode &node : nodes)
+        for (int c = 0; c < BVH_WIDTH; c++)
+            references += node.count[c];
+    return float(references) / triangle_count();
+}
+
+/***************************************************
+ * @brief Moller-Trumbore of one ray against a block of triangles
+ * @return Bitmask of the lanes hit closer than t_max
+ ***************************************************/
+static inline int intersect_block(const TriangleBlock &block, const Ray &ray,
+                                  float t_max, Float4 &t, Float4 &u,
+                                  Float4 &v) {
+    Float4 dx(ray.direction.x), dy(ray.direction.y), dz(ray.direction.z);
+    Float4 e1x = f4_load(block.e1_x), e1y = f4_load(block.e1_y),
+           e1z = f4_load(block.e1_z);
+    Float4 e2x = f4_load(block.e2_x), e2y = f4_load(block.e2_y),
+           e2z = f4_load(block.e2_z);
+
+    Float4 px = dy * e2z - dz * e2y;
+    Float4 py = dz * e2x - dx * e2z;
+    Float4 pz = dx * e2y - dy * e2x;
+    Float4 det = e1x * px + e1y * py + e1z * pz;
+    Mask4 hit = f4_abs(det) > Float4(TINGE_EPSILON);
+    if (!hit.bits())
+        return 0;
+    Float4 inv_det = Float4(1.0f) / det;
+
+    Float4 sx = Float4(ray.origin.x) - f4_load(block.v1_x);
+    Float4 sy = Float4(ray.origin.y) - f4_load(block.v1_y);
+    Float4 sz = Float4(ray.origin.z) - f4_load(block.v1_z);
+    u = (sx * px + sy * py + sz * pz) * inv_det;
+    hit = hit & (u > Float4(0.0f)) & (u < Float4(1.0f));
+    if (!hit.bits())
+        return 0;
+
+    Float4 qx = sy * e1z - sz * e1y;
+    Float4 qy = sz * e1x - sx * e1z;
+    Float4 qz = sx * e1y - sy * e1x;
+    v = (dx * qx + dy * qy + dz * qz) * inv_det;
+    t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+    hit = hit & (v > Float4(0.0f)) & (u + v < Float4(1.0f)) &
+          (t > Float4(0.0f)) & (t < Float4(t_max));
+    return hit.bits();
+}
+
+bool BVH::intersect_closest(const Ray &ray, float t_max,
+                            TriangleHit &hit) const {
+    uint32_t hit_index = 0;
+    float hit_u = 0, hit_v = 0;
+    bool found = false;
+
+    traverse(nodes, ray, t_max,
+             [&](uint32_t first, uint32_t count, float &t_max) {
+                 uint32_t end = first + count;
+                 for (uint32_t b = first / TRIANGLE_BLOCK_SIZE;
+                      b * TRIANGLE_BLOCK_SIZE < end; b++) {
+                     Float4 t, u, v;
+                     int lanes = intersect_block(blocks[b], ray, t_max, t, u, v);
+                     for (int k = 0; lanes; k++, lanes >>= 1)
+                         if ((lanes & 1) && t[k] < t_max) {
+                             t_max = t[k];
+                             hit_index = b * TRIANGLE_BLOCK_SIZE + k;
+                             hit_u = u[k];
+                             hit_v = v[k];
+                             found = true;
+                         }
+                 }
+             });
+
+    if (found)
+        hit = TriangleHit{indices[hit_index], t_max, hit_u, hit_v};
+    return found;
+}
+
+bool BVH::intersect(const Ray &ray, IntersectionOut &intsec_out) const {
+    TriangleHit hit;
+    if (!intersect_closest(ray, intsec_out.t, hit))
+        return false;
+
+    intsec_out.hit = true;
+    intsec_out.t = hit.t;
+    intsec_out.point = ray.at(hit.t);
+    intsec_out.normal = normal(hit.triangle);
+    return true;
+}
+
+int BVH::intersect_packet(const RayPacket &packet, int lanes, Float4 &t_hit,
+                          uint32_t hit_triangle[4]) const {
+    Float4 t_max = packet_t_max(lanes);
+    int hits = 0;
+
+    traverse(nodes, packet, t_max,
+             [&](uint32_t first, uint32_t count, int leaf_lanes,
+                 Float4 &t_max) {
+                 Float4 zero(0.0f), one(1.0f);
+                 for (uint32_t i = first; i < first + count; i++) {
+                     // Moller-Trumbore, one triangle against four rays
+                     const TriangleBlock &block =
+                         blocks[i / TRIANGLE_BLOCK_SIZE];
+                     int k = i % TRIANGLE_BLOCK_SIZE;
+                     Vec3 v1(block.v1_x[k], block.v1_y[k], block.v1_z[k]);
+                     Vec3 e1(block.e1_x[k], block.e1_y[k], block.e1_z[k]);
+                     Vec3 e2(block.e2_x[k], block.e2_y[k], block.e2_z[k]);
+
+                     Float4 px = packet.dy * Float4(e2.z) -
+                                 packet.dz * Float4(e2.y);
+                     Float4 py = packet.dz * Float4(e2.x) -
+                                 packet.dx * Float4(e2.z);
+                     Float4 pz = packet.dx * Float4(e2.y) -
+                                 packet.dy * Float4(e2.x);
+                     Float4 det = Float4(e1.x) * px + Float4(e1.y) * py +
+                                  Float4(e1.z) * pz;
+                     Float4 inv_det = one / det;
+
+                     Float4 tx = packet.ox - Float4(v1.x);
+                     Float4 ty = packet.oy - Float4(v1.y);
+                     Float4 tz = packet.oz - Float4(v1.z);
+                     Float4 u = (tx * px + ty * py + tz * pz) * inv_det;
+
+                     Float4 qx = ty * Float4(e1.z) - tz * Float4(e1.y);
+                     Float4 qy = tz * Float4(e1.x) - tx * Float4(e1.z);
+                     Float4 qz = tx * Float4(e1.y) - ty * Float4(e1.x);
+                     Float4 v = (packet.dx * qx + packet.dy * qy +
+                                 packet.dz * qz) *
+                                inv_det;
+                     Float4 t = (Float4(e2.x) * qx + Float4(e2.y) * qy +
+                                 Float4(e2.z) * qz) *
+                                inv_det;
+
+                     Mask4 hit = (f4_abs(det) > Float4(TINGE_EPSILON)) &
+                                 (u > zero) & (v > zero) &
+                                 (u + v < one) & (t > zero) & (t < t_max) &
+                                 mask_from_bits(leaf_lanes);
+                     int hit_lanes = hit.bits();
+                     if (!hit_lanes)
+                         continue;
+
+                     t_max = select(hit, t, t_max);
+                     hits |= hit_lanes;
+                     for (int k = 0; k < 4; k++)
+                         if (hit_lanes & (1 << k))
+                             hit_triangle[k] = indices[i];
+                 }
+             });
+
+    t_hit = t_max;
+    return hits;
+}
+
+void SceneBVH::build(const std::vector<obj_pointer> &scene_shapes) {
+    shapes.clear();
+    unbounded.clear();
+
+    std::vector<BVH_Volume> bounds;
+    std::unique_ptr<BVH_Node> root = std::make_unique<BVH_Node>();
+
+    for (const auto &shape : scene_shapes) {
+        BVH_Volume volume;
+        if (!shape->get_bounds(volume.min, volume.max)) {
+            unbounded.push_back(shape.get());
+            continue;
+        }
+        // Shapes with nothing to hit, such as empty meshes, are left out
+        if (volume.min.x > volume.max.x)
+            continue;
+        volume.centre = (volume.min + volume.max) / 2;
+        root->volume.expand(volume);
+        root->primitives.push_back(shapes.size());
+        shapes.push_back(shape.get());
+        bounds.push_back(volume);
+    }
+
+    if (shapes.empty()) {
+        nodes.clear();
+        indices.clear();
+    } else {
+        split_sah(root, bounds);
+        ::flatten(root, nodes, indices);
+    }
+
+    std::cout << "[BVH] Constructed scene BVH over " << shapes.size()
+              << " shapes (" << nodes.size() << " nodes), "
+              << unbounded.size() << " unbounded" << std::endl;
+}
+
+std::pair<AbstractShape *, IntersectionOut>
+closestIntersect(const SceneBVH &scene, const Ray &ray) {
+    IntersectionOut min_hit;
+    min_hit.t = TINGE_INFINITY;
+    AbstractShape *min_shape = NULL;
+
+    for (AbstractShape *shape : scene.unbounded) {
+        IntersectionOut ans = shape->intersect(ray);
+        if (ans.hit && ans.t < min_hit.t) {
+            min_hit = ans;
+            min_shape = shape;
+        }
+    }
+
+    float t_max = min_hit.t;
+    traverse(scene.nodes, ray, t_max,
+             [&](uint32_t first, uint32_t count, float &t_max) {
+                 for (uint32_t i = first; i < first + count; i++) {
+                     AbstractShape *shape = scene.shapes[scene.indices[i]];
+                     IntersectionOut ans = shape->intersect(ray);
+                     if (ans.hit && ans.t < t_max) {
+                         min_hit = ans;
+                         min_shape = shape;
+                         t_max = ans.t;
+                     }
+                 }
+             });
+
+    return std::pair<AbstractShape *, IntersectionOut>(min_shape, min_hit);
+}
+
+void closestIntersect(const SceneBVH &scene, const RayPacket &packet,
+                      std::pair<AbstractShape *, IntersectionOut> out[4]) {
+    if (!packet.coherent()) {
+        for (int i = 0; i < 4; i++)
+            if (packet.active & (1 << i))
+                out[i] = closestIntersect(scene, packet.rays[i]);
+        return;
+    }
+
+    IntersectionOut ans[4];
+    for (int i = 0; i < 4; i++) {
+        out[i].first = NULL;
+        out[i].second = IntersectionOut();
+        out[i].second.t = TINGE_INFINITY;
+    }
+
+    auto keep_closer = [&](AbstractShape *shape, int lanes) {
+        for (int i = 0; i < 4; i++)
+            if ((lanes & (1 << i)) && ans[i].hit &&
+                ans[i].t < out[i].second.t) {
+                out[i].first = shape;
+                out[i].second = ans[i];
+            }
+    };
+
+    for (AbstractShape *shape : scene.unbounded) {
+        shape->intersect_packet(packet, packet.active, ans);
+        keep_closer(shape, packet.active);
+    }
+
+    Float4 t_max = select(mask_from_bits(packet.active),
+                          Float4(out[0].second.t, out[1].second.t,
+                                 out[2].second.t, out[3].second.t),
+                          packet_t_max(0));
+    traverse(scene.nodes, packet, t_max,
+             [&](uint32_t first, uint32_t count, int lanes, Float4 &t_max) {
+                 for (uint32_t i = first; i < first + count; i++) {
+                     AbstractShape *shape = scene.shapes[scene.indices[i]];
+                     shape->intersect_packet(packet, lanes, ans);
+                     keep_closer(shape, lanes);
+                 }
+                 t_max = select(mask_from_bits(packet.active),
+                                Float4(out[0].second.t, out[1].second.t,
+                                       out[2].second.t, out[3].second.t),
+                                packet_t_max(0));
+             });
 }
@@ -2,7 +2,11 @@
 
 #include "math.h"
 #include "objects.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <utility>
 #include <vector>
 
 /***********************************
@@ -22,18 +26,24 @@ struct BVH_Volume {
     void expand(const Vec3 &point);
 
     /***************************************************
-     * @brief Check boolean intersection with volume
-     * @param ray Ray to check
-     * @return Ray hit bool
+     * @brief Expanding volume to accomodate another volume
+     * @param other Volume to include
      ***************************************************/
-    const bool intersect(const Ray &ray) const;
+    void expand(const BVH_Volume &other);
 
     /***************************************************
-     * @brief Get minimum length to intersect cube
-     * @param ray Ray to check
-     * @return Distance to cube
+     * @brief Surface area of the volume
+     * @return Surface area, 0 if the volume is empty
      ***************************************************/
-    const float heuristic_intersect(const Ray &ray) const;
+    float surface_area() const;
+};
+
+/***********************************
+ * Strategy used to split BVH nodes
+ ***********************************/
+enum struct BVH_Split {
+    MIDPOINT, /**< Cut longest axis at the centre to a fixed height*/
+    SAH       /**< Binned surface area heuristic, adaptive leaf size*/
 };
 
 /***********************************
@@ -43,13 +53,415 @@ struct BVH_Node {
     struct BVH_Volume volume;                   /**< Bounding volume*/
     std::unique_ptr<BVH_Node> childA = nullptr; /**< Child A*/
     std::unique_ptr<BVH_Node> childB = nullptr; /**< Child B*/
-    std::vector<std::unique_ptr<Triangle>>
-        triangles; /**< Triangles in node; empty if node is not a leaf*/
+    std::vector<uint32_t> primitives; /**< Indices of the primitives in the
+                                         node; empty if not a leaf*/
 };
 
+struct BVH;
+
+/*************************************
+ * Deepest tree either builder makes, keeps every traversal within
+ * BVH_STACK_SIZE
+ *************************************/
+constexpr int BVH_MAX_DEPTH = 48;
+
 /***************************************************
  * @brief Splits BVH node into tree of height max_depth
+ * Triangles straddling the split are referenced by both children. Large
+ * subtrees are split on separate threads.
  * @param root Root of BVH tree
- * @param max_depth Height of final tree
+ * @param max_depth Height of final tree, at most BVH_MAX_DEPTH
+ * @param mesh Triangles referenced by the node indices
+ * @param num_threads Most threads used at once, 0 for one per hardware
+ * thread
+ ***************************************************/
+void split(std::unique_ptr<BVH_Node> &root, int max_depth, const BVH &mesh,
+           unsigned int num_threads = 0);
+
+/***************************************************
+ * @brief Splits BVH node using the binned surface area heuristic
+ * Splitting stops once a leaf is cheaper than the best split. Large
+ * subtrees are split on separate threads, and the largest nodes are also
+ * binned and partitioned by several threads. The tree is the same for
+ * any thread count.
+ * @param root Root of BVH tree
+ * @param bounds Bounds of the primitives referenced by the node indices,
+ * binned by their centre
+ * @param num_bins Number of bins tried along each axis
+ * @param leaf_block Primitives a leaf tests at the cost of one
+ * @param num_threads Most threads used at once, 0 for one per hardware
+ * thread
+ ***************************************************/
+void split_sah(std::unique_ptr<BVH_Node> &root,
+               const std::vector<BVH_Volume> &bounds, int num_bins = 16,
+               int leaf_block = 1, unsigned int num_threads = 0);
+
+/***********************************
+ * Number of children per collapsed BVH node
+ ***********************************/
+constexpr int BVH_WIDTH = 4;
+
+/***********************************
+ * Collapsed BVH node holding up to four children (128 bytes)
+ * Child bounds are stored per axis so all children are tested with one
+ * SIMD slab test. Leaves are kept inline in the slot of their parent and
+ * nodes are stored in depth-first order.
+ ***********************************/
+struct alignas(64) BVH_WideNode {
+    float min_x[BVH_WIDTH], min_y[BVH_WIDTH],
+        min_z[BVH_WIDTH]; /**< Min corners of the child boxes*/
+    float max_x[BVH_WIDTH], max_y[BVH_WIDTH],
+        max_z[BVH_WIDTH]; /**< Max corners of the child boxes*/
+    uint32_t offset[BVH_WIDTH]; /**< Leaf: first primitive; interior: child
+                                     node index*/
+    uint32_t count[BVH_WIDTH];  /**< Number of primitives; 0 if the child is
+                                     not a leaf*/
+};
+
+static_assert(sizeof(BVH_WideNode) == 128, "BVH_WideNode must be 128 bytes");
+
+/***************************************************
+ * @brief Collapses a binary BVH tree into depth-first wide nodes
+ * Interior children with the largest surface area are opened first.
+ * @param root Root of BVH tree, released afterwards
+ * @param nodes Output nodes
+ * @param indices Output leaf primitive indices, contiguous per leaf
+ * @param leaf_align Leaves start at multiples of this many indices, the gap
+ * after a leaf repeats its last primitive
+ ***************************************************/
+void flatten(std::unique_ptr<BVH_Node> &root, std::vector<BVH_WideNode> &nodes,
+             std::vector<uint32_t> &indices, int leaf_align = 1);
+
+/***************************************************
+ * @brief Slab test of a ray against all children of a node
+ * @param node Node to check
+ * @param ray Ray to check
+ * @param t_max Distance beyond which a box is ignored
+ * @return Per child entry distance, TINGE_INFINITY where the box is missed
+ ***************************************************/
+static inline Float4 box_distance(const BVH_WideNode &node, const Ray &ray,
+                                  float t_max) {
+    Float4 ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z);
+    Float4 ix(ray.inv_dir.x), iy(ray.inv_dir.y), iz(ray.inv_dir.z);
+
+    Float4 tx1 = (f4_load(node.min_x) - ox) * ix;
+    Float4 tx2 = (f4_load(node.max_x) - ox) * ix;
+    Float4 tmin = f4_min(tx1, tx2), tmax = f4_max(tx1, tx2);
+
+    Float4 ty1 = (f4_load(node.min_y) - oy) * iy;
+    Float4 ty2 = (f4_load(node.max_y) - oy) * iy;
+    tmin = f4_max(tmin, f4_min(ty1, ty2));
+    tmax = f4_min(tmax, f4_max(ty1, ty2));
+
+    Float4 tz1 = (f4_load(node.min_z) - oz) * iz;
+    Float4 tz2 = (f4_load(node.max_z) - oz) * iz;
+    tmin = f4_max(tmin, f4_min(tz1, tz2));
+    tmax = f4_min(tmax, f4_max(tz1, tz2));
+
+    Mask4 hit =
+        (tmax >= tmin) & (tmax > Float4(0.0f)) & (tmin < Float4(t_max));
+    return select(hit, tmin, Float4(TINGE_INFINITY));
+}
+
+// Deepest pending stack a traversal can need, at most three deferred
+// children per level
+constexpr int BVH_STACK_SIZE = 256;
+static_assert(BVH_STACK_SIZE >= 3 * BVH_MAX_DEPTH + 1,
+              "Traversal stack too small for the deepest tree");
+
+/***************************************************
+ * @brief Walks collapsed nodes front to back with an explicit stack
+ * @param nodes Collapsed nodes
+ * @param ray Ray to check
+ * @param t_max Closest hit so far, lowered by leaf_test
+ * @param leaf_test Called as leaf_test(first, count, t_max) for every leaf
+ * reached
+ ***************************************************/
+template <typename LeafTest>
+void traverse(const std::vector<BVH_WideNode> &nodes, const Ray &ray,
+              float &t_max, LeafTest &&leaf_test) {
+    if (nodes.empty())
+        return;
+
+    // Pending children along with their entry distances
+    struct Entry {
+        uint32_t offset;
+        uint32_t count;
+        float t;
+    } stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = {0, 0, 0};
+
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (entry.t >= t_max)
+            continue;
+
+        if (entry.count > 0) {
+            leaf_test(entry.offset, entry.count, t_max);
+            continue;
+        }
+
+        const BVH_WideNode &node = nodes[entry.offset];
+        Float4 t = box_distance(node, ray, t_max);
+        int hits = (t < Float4(t_max)).bits();
+        if (!hits)
+            continue;
+
+        // Push hit children far to near so the nearest is popped first
+        alignas(16) float t_child[BVH_WIDTH];
+        f4_store(t_child, t);
+        Entry children[BVH_WIDTH];
+        int num_children = 0;
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            if (!(hits & (1 << i)))
+                continue;
+            Entry child = {node.offset[i], node.count[i], t_child[i]};
+            int j = num_children++;
+            for (; j > 0 && children[j - 1].t < child.t; j--)
+                children[j] = children[j - 1];
+            children[j] = child;
+        }
+        for (int i = 0; i < num_children; i++)
+            stack[top++] = children[i];
+    }
+}
+
+/***************************************************
+ * @brief Slab test of a ray packet against one child of a node
+ * @param node Node to check
+ * @param child Slot of the child in the node
+ * @param packet Rays to check
+ * @param t_max Per lane distance beyond which the box is ignored
+ * @return Per lane entry distance, TINGE_INFINITY where the box is missed
+ ***************************************************/
+static inline Float4 box_distance(const BVH_WideNode &node, int child,
+                                  const RayPacket &packet,
+                                  const Float4 &t_max) {
+    Float4 tx1 = (Float4(node.min_x[child]) - packet.ox) * packet.ix;
+    Float4 tx2 = (Float4(node.max_x[child]) - packet.ox) * packet.ix;
+    Float4 tmin = f4_min(tx1, tx2), tmax = f4_max(tx1, tx2);
+
+    Float4 ty1 = (Float4(node.min_y[child]) - packet.oy) * packet.iy;
+    Float4 ty2 = (Float4(node.max_y[child]) - packet.oy) * packet.iy;
+    tmin = f4_max(tmin, f4_min(ty1, ty2));
+    tmax = f4_min(tmax, f4_max(ty1, ty2));
+
+    Float4 tz1 = (Float4(node.min_z[child]) - packet.oz) * packet.iz;
+    Float4 tz2 = (Float4(node.max_z[child]) - packet.oz) * packet.iz;
+    tmin = f4_max(tmin, f4_min(tz1, tz2));
+    tmax = f4_min(tmax, f4_max(tz1, tz2));
+
+    Mask4 hit = (tmax >= tmin) & (tmax > Float4(0.0f)) & (tmin < t_max);
+    return select(hit, tmin, Float4(TINGE_INFINITY));
+}
+
+/***************************************************
+ * @brief Per lane closest hit of a packet, -infinity in inactive lanes so
+ * they never enter a box
  ***************************************************/
-void split(std::unique_ptr<BVH_Node> &root, int max_depth);
+static inline Float4 packet_t_max(int lanes) {
+    return select(mask_from_bits(lanes), Float4(TINGE_INFINITY),
+                  Float4(-std::numeric_limits<float>::infinity()));
+}
+
+/***************************************************
+ * @brief Walks collapsed nodes with a whole ray packet
+ * Children are visited in the order of the nearest lane entering them.
+ * @param nodes Collapsed nodes
+ * @param packet Rays to check
+ * @param t_max Per lane closest hit so far, lowered by leaf_test
+ * @param leaf_test Called as leaf_test(first, count, lanes, t_max) for every
+ * leaf entered by the lanes set in the bitmask
+ ***************************************************/
+template <typename LeafTest>
+void traverse(const std::vector<BVH_WideNode> &nodes,
+              const RayPacket &packet, Float4 &t_max, LeafTest &&leaf_test) {
+    if (nodes.empty())
+        return;
+
+    // Pending children along with their per lane entry distances
+    struct Entry {
+        uint32_t offset;
+        uint32_t count;
+        Float4 t;
+    } stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = {0, 0, Float4(0.0f)};
+
+    while (top > 0) {
+        Entry entry = stack[--top];
+        int lanes = (entry.t < t_max).bits();
+        if (!lanes)
+            continue;
+
+        if (entry.count > 0) {
+            leaf_test(entry.offset, entry.count, lanes, t_max);
+            continue;
+        }
+
+        // Push entered children far to near, keyed by their nearest lane
+        const BVH_WideNode &node = nodes[entry.offset];
+        Entry children[BVH_WIDTH];
+        float nearest[BVH_WIDTH];
+        int num_children = 0;
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            Float4 t = box_distance(node, i, packet, t_max);
+            int hits = (t < t_max).bits() & lanes;
+            if (!hits)
+                continue;
+
+            float t_near = TINGE_INFINITY;
+            for (int k = 0; k < 4; k++)
+                if (hits & (1 << k))
+                    t_near = std::min(t_near, t[k]);
+
+            int j = num_children++;
+            for (; j > 0 && nearest[j - 1] < t_near; j--) {
+                children[j] = children[j - 1];
+                nearest[j] = nearest[j - 1];
+            }
+            children[j] = {node.offset[i], node.count[i], t};
+            nearest[j] = t_near;
+        }
+        for (int i = 0; i < num_children; i++)
+            stack[top++] = children[i];
+    }
+}
+
+/***********************************
+ * Number of triangles tested together by the leaf kernel
+ ***********************************/
+constexpr int TRIANGLE_BLOCK_SIZE = 4;
+
+/***********************************
+ * Triangles in SoA layout for the batch leaf kernel (144 bytes)
+ * Unused lanes hold degenerate triangles that are never hit.
+ ***********************************/
+struct alignas(16) TriangleBlock {
+    float v1_x[TRIANGLE_BLOCK_SIZE], v1_y[TRIANGLE_BLOCK_SIZE],
+        v1_z[TRIANGLE_BLOCK_SIZE]; /**< First vertices*/
+    float e1_x[TRIANGLE_BLOCK_SIZE], e1_y[TRIANGLE_BLOCK_SIZE],
+        e1_z[TRIANGLE_BLOCK_SIZE]; /**< Edges from v1 to v2*/
+    float e2_x[TRIANGLE_BLOCK_SIZE], e2_y[TRIANGLE_BLOCK_SIZE],
+        e2_z[TRIANGLE_BLOCK_SIZE]; /**< Edges from v1 to v3*/
+};
+
+/***********************************
+ * Closest triangle hit found by the leaf kernel
+ ***********************************/
+struct TriangleHit {
+    uint32_t triangle; /**< Index of the triangle in the mesh*/
+    float t;           /**< Distance along the ray*/
+    float u, v;        /**< Barycentrics of v2 and v3*/
+};
+
+/***********************************
+ * Collapsed BVH for traversal over an indexed triangle mesh
+ * Triangles only exist as three vertex indices, anything else about them
+ * is worked out from the vertices when needed.
+ ***********************************/
+struct BVH {
+    std::vector<BVH_WideNode> nodes; /**< Nodes in depth-first order*/
+    BVH_Volume bounds;               /**< Bounds of all triangles*/
+    std::vector<Vec3> vertices;      /**< Positions shared by the triangles*/
+    std::vector<uint32_t> triangles; /**< Three vertex indices per triangle*/
+    std::vector<uint32_t> indices;     /**< Leaf triangle references, each
+                                            leaf starts a block*/
+    std::vector<TriangleBlock> blocks; /**< Kernel data of the referenced
+                                            triangles, one lane per index*/
+
+    size_t triangle_count() const { return triangles.size() / 3; }
+
+    /***************************************************
+     * @brief Vertex k of a triangle
+     ***************************************************/
+    const Vec3 &vertex(uint32_t triangle, int k) const {
+        return vertices[triangles[3 * triangle + k]];
+    }
+
+    /***************************************************
+     * @brief Unit normal of a triangle
+     ***************************************************/
+    Vec3 normal(uint32_t triangle) const;
+
+    /***************************************************
+     * @brief Bounds of a triangle, centred on its centroid
+     ***************************************************/
+    BVH_Volume triangle_bounds(uint32_t triangle) const;
+
+    /***************************************************
+     * @brief Collapses a BVH tree built over the triangles
+     * @param root Root of BVH tree, released afterwards
+     ***************************************************/
+    void flatten(std::unique_ptr<BVH_Node> &root);
+
+    /***************************************************
+     * @brief Average number of leaves referencing each triangle
+     * @return 1 if no triangle is shared between leaves
+     ***************************************************/
+    float duplication_factor() const;
+
+    /***************************************************
+     * @brief Finds the closest triangle hit by the ray
+     * @param ray Ray to check in world space
+     * @param t_max Distance beyond which hits are ignored
+     * @param hit Closest hit, only written on a hit
+     * @return Did ray hit a triangle closer than t_max
+     ***************************************************/
+    bool intersect_closest(const Ray &ray, float t_max, TriangleHit &hit) const;
+
+    /***************************************************
+     * @brief Finds the closest triangle hit by the ray
+     * @param ray Ray to check in world space
+     * @param intsec_out Closest hit, only updated if closer than its t
+     * @return Did ray hit a triangle closer than intsec_out.t
+     ***************************************************/
+    bool intersect(const Ray &ray, IntersectionOut &intsec_out) const;
+
+    /***************************************************
+     * @brief Finds the closest triangle hit by each ray of a packet
+     * @param packet Rays to check in world space
+     * @param lanes Bitmask of the lanes to check
+     * @param t_hit Per lane distance to the closest hit
+     * @param hit_triangle Per lane index of the closest triangle
+     * @return Bitmask of the lanes that hit a triangle
+     ***************************************************/
+    int intersect_packet(const RayPacket &packet, int lanes, Float4 &t_hit,
+                         uint32_t hit_triangle[4]) const;
+};
+
+/***********************************
+ * Top level BVH over the world bounds of all scene shapes
+ * Meshes keep their own BVH as the bottom level.
+ ***********************************/
+struct SceneBVH {
+    std::vector<BVH_WideNode> nodes;        /**< Nodes in depth-first order*/
+    std::vector<uint32_t> indices;          /**< Leaf references into shapes*/
+    std::vector<AbstractShape *> shapes;    /**< Bounded shapes*/
+    std::vector<AbstractShape *> unbounded; /**< Shapes checked by every ray*/
+
+    /***************************************************
+     * @brief Builds the top level BVH
+     * @param scene_shapes Shapes of the scene, must outlive the SceneBVH
+     ***************************************************/
+    void build(const std::vector<obj_pointer> &scene_shapes);
+};
+
+/******************************************************
+ * @brief Find closest shape that intersects the ray
+ * @param scene Top level BVH of the scene
+ * @param ray Ray to check with
+ ******************************************************/
+std::pair<AbstractShape *, IntersectionOut>
+closestIntersect(const SceneBVH &scene, const Ray &ray);
+
+/******************************************************
+ * @brief Find closest shapes that intersect a ray packet
+ * Incoherent packets fall back to tracing each ray on its own.
+ * @param scene Top level BVH of the scene
+ * @param packet Rays to check with
+ * @param out Closest shape and hit for each active lane
+ ******************************************************/
+void closestIntersect(const SceneBVH &scene, const RayPacket &packet,
+                      std::pair<AbstractShape *, IntersectionOut> out[4]);
@@ -23,6 +23,49 @@ Ray ::Ray(Vec3 origin, Vec3 direction)
  ***************/
 Vec3 Ray::at(float t) const { return origin + direction * t; }
 
+/***************
+ * Builds the SoA lanes from the rays of the packet
+ * @par lanes : bitmask of the lanes holding a ray
+ ***************/
+void RayPacket::pack(int lanes) {
+    active = lanes;
+    int first = 0;
+    while (first < 3 && !(lanes & (1 << first)))
+        first++;
+
+    const Ray *r[4];
+    for (int i = 0; i < 4; i++)
+        r[i] = (lanes & (1 << i)) ? &rays[i] : &rays[first];
+
+    ox = Float4(r[0]->origin.x, r[1]->origin.x, r[2]->origin.x, r[3]->origin.x);
+    oy = Float4(r[0]->origin.y, r[1]->origin.y, r[2]->origin.y, r[3]->origin.y);
+    oz = Float4(r[0]->origin.z, r[1]->origin.z, r[2]->origin.z, r[3]->origin.z);
+    dx = Float4(r[0]->direction.x, r[1]->direction.x, r[2]->direction.x,
+                r[3]->direction.x);
+    dy = Float4(r[0]->direction.y, r[1]->direction.y, r[2]->direction.y,
+                r[3]->direction.y);
+    dz = Float4(r[0]->direction.z, r[1]->direction.z, r[2]->direction.z,
+                r[3]->direction.z);
+    ix = Float4(r[0]->inv_dir.x, r[1]->inv_dir.x, r[2]->inv_dir.x,
+                r[3]->inv_dir.x);
+    iy = Float4(r[0]->inv_dir.y, r[1]->inv_dir.y, r[2]->inv_dir.y,
+                r[3]->inv_dir.y);
+    iz = Float4(r[0]->inv_dir.z, r[1]->inv_dir.z, r[2]->inv_dir.z,
+                r[3]->inv_dir.z);
+}
+
+/***************
+ * @return true if the direction signs agree across all active lanes
+ ***************/
+bool RayPacket::coherent() const {
+    Float4 zero(0.0f);
+    int sx = (dx < zero).bits() & active;
+    int sy = (dy < zero).bits() & active;
+    int sz = (dz < zero).bits() & active;
+    return (sx == 0 || sx == active) && (sy == 0 || sy == active) &&
+           (sz == 0 || sz == active);
+}
+
 /***************
  * parameterized constructor for class Camera
  * @par film-height : It is the vertical measurement of the film
@@ -45,11 +88,11 @@ Camera ::~Camera() {}
 /********************
  * Given NDC coordinates (u, v), should generate the corresponding ray
  * @par (u,v) NDC coordinates of a point
- * @par random_gen : member function of class Random
+ * @par sampler : source of the aperture sample
  * @return Corresponding ray to that point
  */
 
-Ray Camera ::generate_ray(float u, float v, Random &random_gen) {
+Ray Camera ::generate_ray(float u, float v, Sampler &sampler) {
 
     float aspect_ratio = static_cast<float>(film_width) / film_height;
     float half_height = (focal_length)*tan((vertical_fov) / 2);
@@ -72,7 +115,7 @@ Ray Camera ::generate_ray(float u, float v, Random &random_gen) {
     Vec3 focal_point = Ray(origin, direction.normalized()).at(focal_length);
     // Origin randomly shifted in the aperture only
     Vec3 n_origin =
-        origin + aperture_size * random_gen.GenerateUniformPointDisc();
+        origin + aperture_size * sampler.GenerateUniformPointDisc();
 
     Vec3 n_direction = (focal_point - n_origin).normalized();
 
@@ -1,7 +1,8 @@
 #pragma once
 #include "frame.h"
 #include "math.h"
-#include "random.h"
+#include "sampler.h"
+#include "simd.h"
 
 /*****************
  * A Ray Class
@@ -21,6 +22,30 @@ struct Ray {
     Vec3 at(float t) const;
 };
 
+/*****************
+ * A bundle of four rays in SoA layout, traced together
+ *****************/
+struct RayPacket {
+    Ray rays[4];            // Lanes as plain rays
+    Float4 ox, oy, oz;      // Origins
+    Float4 dx, dy, dz;      // Directions
+    Float4 ix, iy, iz;      // Inverse directions
+    int active = 0;         // Bit i is set if lane i holds a ray
+
+    /***************************************
+     * @brief Packs the rays of the active lanes, inactive lanes copy an
+     * active one so every lane stays finite
+     * @param lanes Bitmask of lanes filled in rays
+     ****************************************/
+    void pack(int lanes);
+
+    /***************************************
+     * @brief Checks if all active rays point into the same octant, the
+     * condition for tracing them as a packet
+     ****************************************/
+    bool coherent() const;
+};
+
 /*************************************************************************
  * Generates reflected ray given a ray , normal and the point of incident
  * @param incident ray
@@ -94,7 +119,7 @@ struct Camera {
     /************************************************************************
     * @brief Given NDC coordinates (u, v) generates the corresponding ray
     ************************************************************************/
-    Ray generate_ray(float u, float v, Random &random_gen);
+    Ray generate_ray(float u, float v, Sampler &sampler);
     
     /************************************************************************
     * @brief Positions the camera frame to orient in such a way that the camera
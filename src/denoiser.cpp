@@ -0,0 +1,191 @@
+#include "denoiser.h"
+#include "math.h"
+#include "util.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+/*************************************
+ * Number of a-trous passes, the last one reaches 2^(n-1) * 2 pixels away
+ *************************************/
+constexpr int ATROUS_PASSES = 5;
+
+/*************************************
+ * Side of the square tiles the passes are split into
+ *************************************/
+constexpr int DENOISE_TILE_SIZE = 32;
+
+/*************************************
+ * Edge-stopping strengths, as in the SVGF paper
+ *************************************/
+constexpr float SIGMA_LUMINANCE = 4;
+constexpr float SIGMA_DEPTH = 1;
+constexpr int NORMAL_POWER_LOG2 = 7; /**< Normals are weighed by cos^128*/
+
+/*************************************
+ * Smallest albedo the lighting is divided by
+ *************************************/
+constexpr float MIN_ALBEDO = 1e-3f;
+
+/***************************************************
+ * @brief Runs fn(x0, y0, x1, y1) over tiles of the image on several threads
+ ***************************************************/
+template <typename F>
+static void parallel_tiles(int width, int height, unsigned int num_threads,
+                           F fn) {
+    int tiles_x = (width + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+    int tiles_y = (height + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+    int num_tiles = tiles_x * tiles_y;
+    std::atomic<int> next_tile(0);
+
+    auto worker = [&]() {
+        for (int tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+            int x0 = (tile % tiles_x) * DENOISE_TILE_SIZE;
+            int y0 = (tile / tiles_x) * DENOISE_TILE_SIZE;
+            fn(x0, y0, std::min(x0 + DENOISE_TILE_SIZE, width),
+               std::min(y0 + DENOISE_TILE_SIZE, height));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < std::max(1u, num_threads); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+static inline Vec3 load3(const float *p, size_t pix) {
+    return Vec3(p[pix * 3], p[pix * 3 + 1], p[pix * 3 + 2]);
+}
+
+static inline void store3(float *p, size_t pix, const Vec3 &v) {
+    p[pix * 3] = v.x;
+    p[pix * 3 + 1] = v.y;
+    p[pix * 3 + 2] = v.z;
+}
+
+static inline Vec3 safe_albedo(const float *albedo, size_t pix) {
+    Vec3 a = load3(albedo, pix);
+    return Vec3(std::max(a.x, MIN_ALBEDO), std::max(a.y, MIN_ALBEDO),
+                std::max(a.z, MIN_ALBEDO));
+}
+
+void denoise(float *rgb, const FeatureBuffers &features, int width, int height,
+             unsigned int num_threads) {
+    size_t num_pixels = size_t(width) * height;
+    std::vector<Vec3> lighting(num_pixels), next_lighting(num_pixels);
+    std::vector<float> variance(num_pixels), next_variance(num_pixels);
+    std::vector<float> blurred_variance(num_pixels), depth_gradient(num_pixels);
+
+    // Demodulate: filter the lighting so texture detail is not blurred, its
+    // variance scales with the albedo divided out
+    for (size_t pix = 0; pix < num_pixels; pix++) {
+        Vec3 albedo = safe_albedo(features.albedo, pix);
+        Vec3 c = load3(rgb, pix);
+        lighting[pix] = Vec3(c.x / albedo.x, c.y / albedo.y, c.z / albedo.z);
+        float scale = std::max(luminance(albedo), MIN_ALBEDO);
+        variance[pix] = features.variance[pix] / (scale * scale);
+    }
+
+    // Depth changes expected between neighbours, so slanted surfaces are not
+    // taken for edges
+    auto depth_at = [&](int x, int y) {
+        return features.depth[size_t(std::clamp(y, 0, height - 1)) * width +
+                              std::clamp(x, 0, width - 1)];
+    };
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            depth_gradient[size_t(y) * width + x] =
+                std::max(std::fabs(depth_at(x + 1, y) - depth_at(x - 1, y)),
+                         std::fabs(depth_at(x, y + 1) - depth_at(x, y - 1))) /
+                2;
+
+    const float kernel[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+
+    for (int pass = 0; pass < ATROUS_PASSES; pass++) {
+        int step = 1 << pass;
+
+        // The luminance edge-stopping function uses a 3x3 blurred variance,
+        // single pixel estimates are too noisy
+        parallel_tiles(width, height, num_threads, [&](int x0, int y0, int x1,
+                                                       int y1) {
+            const float gauss[3] = {1 / 4.f, 1 / 2.f, 1 / 4.f};
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++) {
+                    float sum = 0;
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dx = -1; dx <= 1; dx++)
+                            sum += gauss[dx + 1] * gauss[dy + 1] *
+                                   variance[size_t(std::clamp(y + dy, 0, height - 1)) *
+                                                width +
+                                            std::clamp(x + dx, 0, width - 1)];
+                    blurred_variance[size_t(y) * width + x] = sum;
+                }
+        });
+
+        parallel_tiles(width, height, num_threads, [&](int x0, int y0, int x1,
+                                                       int y1) {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++) {
+                    size_t p = size_t(y) * width + x;
+                    Vec3 normal_p = load3(features.normal, p);
+                    float depth_p = features.depth[p];
+                    float luminance_p = luminance(lighting[p]);
+                    float luminance_scale =
+                        SIGMA_LUMINANCE * std::sqrt(blurred_variance[p]) + 1e-6f;
+                    float depth_scale = SIGMA_DEPTH * depth_gradient[p] + 1e-3f;
+
+                    // The centre is always kept, pixels without a hit have
+                    // no normal to compare
+                    float centre = kernel[2] * kernel[2];
+                    float weight_sum = centre;
+                    Vec3 lighting_sum = lighting[p] * centre;
+                    float variance_sum = centre * centre * variance[p];
+
+                    for (int dy = -2; dy <= 2; dy++) {
+                        int qy = y + dy * step;
+                        if (qy < 0 || qy >= height)
+                            continue;
+                        for (int dx = -2; dx <= 2; dx++) {
+                            int qx = x + dx * step;
+                            if ((dx == 0 && dy == 0) || qx < 0 || qx >= width)
+                                continue;
+                            size_t q = size_t(qy) * width + qx;
+
+                            float w_normal = std::max(
+                                0.0f, dot(normal_p, load3(features.normal, q)));
+                            for (int i = 0; i < NORMAL_POWER_LOG2; i++)
+                                w_normal *= w_normal;
+                            if (w_normal <= 0)
+                                continue;
+
+                            float offset = step * std::sqrt(float(dx * dx + dy * dy));
+                            float w = kernel[dx + 2] * kernel[dy + 2] * w_normal *
+                                      std::exp(-std::fabs(depth_p - features.depth[q]) /
+                                                   (depth_scale * offset) -
+                                               std::fabs(luminance_p -
+                                                         luminance(lighting[q])) /
+                                                   luminance_scale);
+
+                            weight_sum += w;
+                            lighting_sum = lighting_sum + lighting[q] * w;
+                            variance_sum += w * w * variance[q];
+                        }
+                    }
+
+                    next_lighting[p] = lighting_sum / weight_sum;
+                    next_variance[p] = variance_sum / (weight_sum * weight_sum);
+                }
+        });
+
+        std::swap(lighting, next_lighting);
+        std::swap(variance, next_variance);
+    }
+
+    // Remodulate with the albedo divided out at the start
+    for (size_t pix = 0; pix < num_pixels; pix++)
+        store3(rgb, pix, lighting[pix] * safe_albedo(features.albedo, pix));
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/***********************************
+ * First hit features of every pixel, guiding the denoiser around edges
+ ***********************************/
+struct FeatureBuffers {
+    const float *albedo;   /**< Material colour, three floats per pixel*/
+    const float *normal;   /**< World space normal, three floats per pixel,
+                                zero where the camera ray escaped*/
+    const float *depth;    /**< Distance to the first hit*/
+    const float *variance; /**< Variance of the mean luminance of a pixel*/
+};
+
+/***************************************************
+ * @brief Denoises linear RGB with an edge-avoiding a-trous wavelet filter
+ * Follows SVGF without its temporal part: the albedo is divided out, five
+ * passes of a 5x5 B3 spline kernel with growing holes blur the lighting,
+ * weighed down across normal, depth and luminance edges, and the albedo is
+ * multiplied back in. Each pass is split into tiles across threads.
+ * @param rgb Linear RGB, three floats per pixel, denoised in place
+ * @param features First hit features of the same pixels
+ ***************************************************/
+void denoise(float *rgb, const FeatureBuffers &features, int width, int height,
+             unsigned int num_threads);
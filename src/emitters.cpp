@@ -0,0 +1,323 @@
+#include "emitters.h"
+#include "math.h"
+#include "util.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/***************************************************
+ * @brief Rotates a vector given around +z to be given around an axis
+ ***************************************************/
+static Vec3 around_axis(const Vec3 &v, const Vec3 &axis) {
+    // Same basis as Sampler::GenerateCosinePointHemisphere, flipped near -z
+    // where it degenerates
+    if (axis.z < -0.999f)
+        return around_axis(Vec3(v.x, v.y, -v.z), -axis);
+    float c1 = 1 / (1 + axis.z);
+    float c2 = axis.y * c1;
+    float c3 = axis.x * c1;
+    return Vec3((1 - axis.x * c3) * v.x - axis.x * c2 * v.y + axis.x * v.z,
+                -axis.x * c2 * v.x + (1 - axis.y * c2) * v.y + axis.y * v.z,
+                -axis.x * v.x - axis.y * v.y + axis.z * v.z);
+}
+
+Emitter Emitter::triangle(const Vec3 &v1, const Vec3 &v2, const Vec3 &v3,
+                          AbstractMaterial *material,
+                          const AbstractShape *shape) {
+    Emitter e;
+    e.type = TriangleEmitter;
+    e.v1 = v1;
+    e.e1 = v2 - v1;
+    e.e2 = v3 - v1;
+    e.area = cross(e.e1, e.e2).length() / 2;
+    e.material = material;
+    e.shape = shape;
+    return e;
+}
+
+Emitter Emitter::sphere(const Vec3 &c, float r, AbstractMaterial *material,
+                        const AbstractShape *shape) {
+    Emitter e;
+    e.type = SphereEmitter;
+    e.c = c;
+    e.r = r;
+    e.area = 4 * M_PI * r * r;
+    e.material = material;
+    e.shape = shape;
+    return e;
+}
+
+bool Emitter::sample(const Vec3 &from, Sampler &sampler,
+                     LightSample &out) const {
+    float u1, u2;
+    sampler.get_2d(u1, u2);
+    Vec3 point;
+
+    if (type == TriangleEmitter) {
+        float su = std::sqrt(u1);
+        point = v1 + e1 * (su * (1 - u2)) + e2 * (su * u2);
+        Vec3 to_point = point - from;
+        out.dist = to_point.length();
+        if (out.dist <= 0)
+            return false;
+        out.wi = to_point / out.dist;
+
+        Vec3 normal = cross(e1, e2).normalized();
+        float cos_light = std::fabs(dot(normal, out.wi));
+        if (cos_light < TINGE_EPSILON)
+            return false;
+        out.pdf = out.dist * out.dist / (area * cos_light);
+    } else {
+        Vec3 to_centre = c - from;
+        float d = to_centre.length();
+        if (d <= r)
+            return false;
+
+        // Uniform direction inside the cone subtended by the sphere
+        float cos_max = std::sqrt(std::max(0.0f, 1 - r * r / (d * d)));
+        float cos_theta = 1 - u1 * (1 - cos_max);
+        float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+        float phi = 2 * M_PI * u2;
+        out.wi = around_axis(Vec3(sin_theta * std::cos(phi),
+                                  sin_theta * std::sin(phi), cos_theta),
+                             to_centre / d);
+
+        // Nearest intersection of the sampled direction with the sphere
+        float b = d * cos_theta;
+        out.dist = b - std::sqrt(std::max(0.0f, r * r - d * d + b * b));
+        out.pdf = 1 / (2 * M_PI * (1 - cos_max));
+        point = from + out.wi * out.dist;
+    }
+
+    out.Le = material->Le(Ray(from, out.wi), point);
+    return true;
+}
+
+float Emitter::pdf(const Vec3 &from, const Vec3 &point,
+                   const Vec3 &normal) const {
+    if (type == TriangleEmitter) {
+        Vec3 to_point = point - from;
+        float dist2 = dot(to_point, to_point);
+        float cos_light = std::fabs(dot(normal, to_point)) / std::sqrt(dist2);
+        if (cos_light < TINGE_EPSILON)
+            return 0;
+        return dist2 / (area * cos_light);
+    }
+
+    float d = (c - from).length();
+    if (d <= r)
+        return 0;
+    float cos_max = std::sqrt(std::max(0.0f, 1 - r * r / (d * d)));
+    return 1 / (2 * M_PI * (1 - cos_max));
+}
+
+/***************************************************
+ * @brief Finds the texel of an environment map a direction falls into
+ * @param x Column, from the azimuth
+ * @param r Row counted from +y, from the polar angle
+ ***************************************************/
+static void env_texel(const Vec3 &dir, int width, int height, int &x, int &r,
+                      float &theta) {
+    theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
+    float phi = std::atan2(dir.z, dir.x);
+    if (phi < 0)
+        phi += 2 * M_PI;
+    x = std::clamp(int(phi / (2 * M_PI) * width), 0, width - 1);
+    r = std::clamp(int(theta / M_PI * height), 0, height - 1);
+}
+
+void EnvironmentMap::build(const float *data, int width, int height,
+                           int channels) {
+    clear();
+    this->data = data;
+    this->width = width;
+    this->height = height;
+    this->channels = channels;
+
+    marginal_cdf.assign(height + 1, 0);
+    conditional_cdf.assign(size_t(width + 1) * height, 0);
+    double total = 0;
+    for (int r = 0; r < height; r++) {
+        float sin_theta = std::sin(M_PI * (r + 0.5f) / height);
+        const float *row = data + size_t(height - 1 - r) * width * channels;
+        float *cdf = &conditional_cdf[size_t(width + 1) * r];
+
+        // Rows are summed in double, 8K maps lose small texels in float
+        double sum = 0;
+        for (int x = 0; x < width; x++) {
+            const float *texel = row + size_t(x) * channels;
+            sum += std::max(0.0f, luminance(Vec3(texel[0], texel[1], texel[2]))) *
+                   sin_theta;
+            cdf[x + 1] = sum;
+        }
+        for (int x = 1; x <= width; x++)
+            cdf[x] = sum > 0 ? cdf[x] / sum : float(x) / width;
+        cdf[width] = 1;
+
+        total += sum;
+        marginal_cdf[r + 1] = total;
+    }
+
+    if (total <= 0) {
+        marginal_cdf.clear();
+        conditional_cdf.clear();
+        return;
+    }
+    for (int r = 1; r <= height; r++)
+        marginal_cdf[r] /= total;
+    marginal_cdf[height] = 1;
+
+    std::cout << "[Emitters] Built environment distribution for " << width
+              << "x" << height << " map" << std::endl;
+}
+
+void EnvironmentMap::clear() {
+    data = nullptr;
+    width = height = channels = 0;
+    marginal_cdf.clear();
+    conditional_cdf.clear();
+}
+
+Vec3 EnvironmentMap::lookup(const Vec3 &dir) const {
+    int x, r;
+    float theta;
+    env_texel(dir, width, height, x, r, theta);
+    const float *texel =
+        data + (size_t(height - 1 - r) * width + x) * channels;
+    return Vec3(texel[0], texel[1], texel[2]);
+}
+
+bool EnvironmentMap::sample(Sampler &sampler, LightSample &out) const {
+    if (empty())
+        return false;
+    float u1, u2;
+    sampler.get_2d(u1, u2);
+
+    int r = std::upper_bound(marginal_cdf.begin(), marginal_cdf.end(), u1) -
+            marginal_cdf.begin() - 1;
+    r = std::clamp(r, 0, height - 1);
+    const float *cdf = &conditional_cdf[size_t(width + 1) * r];
+    int x = std::upper_bound(cdf, cdf + width + 1, u2) - cdf - 1;
+    x = std::clamp(x, 0, width - 1);
+
+    float row_pdf = marginal_cdf[r + 1] - marginal_cdf[r];
+    float column_pdf = cdf[x + 1] - cdf[x];
+    if (row_pdf <= 0 || column_pdf <= 0)
+        return false;
+
+    // What is left of the two numbers places the direction inside the texel
+    float dv = clamp((u1 - marginal_cdf[r]) / row_pdf, 0.0f, 0.999999f);
+    float du = clamp((u2 - cdf[x]) / column_pdf, 0.0f, 0.999999f);
+    float theta = M_PI * (r + dv) / height;
+    float phi = 2 * M_PI * (x + du) / width;
+    float sin_theta = std::sin(theta);
+    if (sin_theta <= 0)
+        return false;
+
+    out.wi = Vec3(sin_theta * std::cos(phi), std::cos(theta),
+                  sin_theta * std::sin(phi));
+    out.dist = INFINITY;
+    // Texel probability spread over its solid angle
+    out.pdf = row_pdf * column_pdf * width * height /
+              (2 * M_PI * M_PI * sin_theta);
+    const float *texel =
+        data + (size_t(height - 1 - r) * width + x) * channels;
+    out.Le = Vec3(texel[0], texel[1], texel[2]);
+    return true;
+}
+
+float EnvironmentMap::pdf(const Vec3 &dir) const {
+    if (empty())
+        return 0;
+    int x, r;
+    float theta;
+    env_texel(dir, width, height, x, r, theta);
+    float sin_theta = std::sin(theta);
+    if (sin_theta <= 0)
+        return 0;
+
+    const float *cdf = &conditional_cdf[size_t(width + 1) * r];
+    return (marginal_cdf[r + 1] - marginal_cdf[r]) * (cdf[x + 1] - cdf[x]) *
+           width * height / (2 * M_PI * M_PI * sin_theta);
+}
+
+void EmitterList::build(const std::vector<obj_pointer> &shapes,
+                        const EnvironmentMap *environment) {
+    emitters.clear();
+    cdf.clear();
+    by_shape.clear();
+
+    for (const auto &shape : shapes) {
+        size_t first = emitters.size();
+        shape->get_emitters(emitters);
+        if (emitters.size() > first)
+            by_shape[shape.get()] = first;
+    }
+
+    // Pick emitters in proportion to their emitted power
+    float total = 0;
+    for (Emitter &e : emitters) {
+        Vec3 point = e.type == TriangleEmitter ? e.v1 : e.c;
+        e.select_pdf = e.area * luminance(e.material->Le(Ray(), point));
+        total += e.select_pdf;
+    }
+    for (Emitter &e : emitters) {
+        e.select_pdf = total > 0 ? e.select_pdf / total : 0;
+        cdf.push_back((cdf.empty() ? 0 : cdf.back()) + e.select_pdf);
+    }
+    if (!cdf.empty())
+        cdf.back() = 1;
+
+    // Environment and surface power are not comparable in scene units, the
+    // environment gets half of the light samples when both are present
+    this->environment =
+        environment && !environment->empty() ? environment : nullptr;
+    environment_select =
+        this->environment ? (emitters.empty() ? 1.0f : 0.5f) : 0.0f;
+
+    std::cout << "[Emitters] Collected " << emitters.size()
+              << " emitting surfaces from " << by_shape.size() << " shapes"
+              << std::endl;
+}
+
+bool EmitterList::sample(const Vec3 &from, Sampler &sampler,
+                         LightSample &out) const {
+    // One dimension picks between the environment and the emitters and
+    // then the emitter, so every light sample reads the same dimensions
+    float u = sampler.get_1d();
+    if (environment && u < environment_select) {
+        if (!environment->sample(sampler, out))
+            return false;
+        out.pdf *= environment_select;
+        return true;
+    }
+    if (emitters.empty())
+        return false;
+    if (environment)
+        u = std::min((u - environment_select) / (1 - environment_select),
+                     0x1.fffffep-1f);
+    size_t index = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    const Emitter &e = emitters[std::min(index, emitters.size() - 1)];
+    if (e.select_pdf <= 0 || !e.sample(from, sampler, out))
+        return false;
+    out.pdf *= e.select_pdf * (1 - environment_select);
+    return true;
+}
+
+float EmitterList::pdf(const AbstractShape *shape, const Vec3 &from,
+                       const Vec3 &point, const Vec3 &normal) const {
+    auto it = by_shape.find(shape);
+    if (it == by_shape.end())
+        return 0;
+
+    // Triangles of one shape share a material, so picking any of them by
+    // power has the same probability per unit area
+    const Emitter &e = emitters[it->second];
+    return e.select_pdf * (1 - environment_select) * e.pdf(from, point, normal);
+}
+
+float EmitterList::environment_pdf(const Vec3 &dir) const {
+    if (!environment)
+        return 0;
+    return environment_select * environment->pdf(dir);
+}
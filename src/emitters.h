@@ -0,0 +1,172 @@
+#pragma once
+
+#include "camera.h"
+#include "material.h"
+#include "math.h"
+#include "objects.h"
+#include "sampler.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+enum EmitterType { TriangleEmitter, SphereEmitter };
+
+/***********************************
+ * Direction towards a point sampled on an emitter
+ ***********************************/
+struct LightSample {
+    Vec3 wi;    /**< Normalized direction towards the emitter*/
+    float dist; /**< Distance to the sampled point, infinite for the
+                     environment*/
+    float pdf;  /**< Solid angle pdf, including picking the emitter*/
+    Vec3 Le;    /**< Emitted radiance arriving along wi*/
+};
+
+/***********************************
+ * Emitting surface in world space
+ ***********************************/
+struct Emitter {
+    EmitterType type;
+    Vec3 v1, e1, e2;            /**< Triangle vertex and edges*/
+    Vec3 c;                     /**< Sphere centre*/
+    float r = 0;                /**< Sphere radius*/
+    float area = 0;             /**< Surface area*/
+    AbstractMaterial *material; /**< Emissive material*/
+    const AbstractShape *shape; /**< Scene shape the surface belongs to*/
+    float select_pdf = 0;       /**< Probability of being picked*/
+
+    /***************************************************
+     * @brief Emitter for a triangle given in world space
+     ***************************************************/
+    static Emitter triangle(const Vec3 &v1, const Vec3 &v2, const Vec3 &v3,
+                            AbstractMaterial *material,
+                            const AbstractShape *shape);
+
+    /***************************************************
+     * @brief Emitter for a sphere given in world space
+     ***************************************************/
+    static Emitter sphere(const Vec3 &c, float r, AbstractMaterial *material,
+                          const AbstractShape *shape);
+
+    /***************************************************
+     * @brief Samples a direction towards the emitter
+     * Triangles are sampled by area, spheres by the cone they subtend.
+     * @param from Point receiving the light
+     * @param sampler Source of the light sample
+     * @param out Sampled direction, pdf excludes picking the emitter
+     * @return False if no direction could be sampled
+     ***************************************************/
+    bool sample(const Vec3 &from, Sampler &sampler, LightSample &out) const;
+
+    /***************************************************
+     * @brief Solid angle pdf of sample() reaching a point of the emitter
+     * @param from Point receiving the light
+     * @param point Point hit on the emitter
+     * @param normal Surface normal at the hit point
+     * @return Pdf excluding picking the emitter
+     ***************************************************/
+    float pdf(const Vec3 &from, const Vec3 &point, const Vec3 &normal) const;
+};
+
+/***********************************
+ * Equirectangular environment map importance sampled by texel luminance
+ * Rows hold the polar angle from +y, columns the azimuth from +x towards +z.
+ ***********************************/
+struct EnvironmentMap {
+    const float *data = nullptr; /**< Texels, bottom row first*/
+    int width = 0, height = 0, channels = 0;
+    std::vector<float> marginal_cdf; /**< Running sum of row probabilities,
+                                          height + 1 entries*/
+    std::vector<float> conditional_cdf; /**< Running sum of texel
+                                             probabilities within each row,
+                                             width + 1 entries per row*/
+
+    /***************************************************
+     * @brief Builds the sampling distribution of a loaded map
+     * Texels are weighed by luminance times the sine of their polar angle,
+     * so rows shrinking towards the poles are picked less often.
+     * @param data Texels as loaded by stbi_loadf, must outlive the map
+     ***************************************************/
+    void build(const float *data, int width, int height, int channels);
+
+    void clear();
+
+    bool empty() const { return marginal_cdf.empty(); }
+
+    /***************************************************
+     * @brief Radiance of the texel a direction falls into
+     ***************************************************/
+    Vec3 lookup(const Vec3 &dir) const;
+
+    /***************************************************
+     * @brief Samples a direction in proportion to the radiance arriving
+     * @param sampler Source of the light sample
+     * @param out Sampled direction at infinite distance
+     * @return False if no direction could be sampled
+     ***************************************************/
+    bool sample(Sampler &sampler, LightSample &out) const;
+
+    /***************************************************
+     * @brief Solid angle pdf of sample() picking a direction
+     ***************************************************/
+    float pdf(const Vec3 &dir) const;
+};
+
+/***********************************
+ * All emitters of a scene, picked in proportion to their power, and the
+ * environment map if one is sampled
+ ***********************************/
+struct EmitterList {
+    std::vector<Emitter> emitters; /**< Emitting surfaces*/
+    std::vector<float> cdf;        /**< Running sum of pick probabilities*/
+    std::unordered_map<const AbstractShape *, uint32_t>
+        by_shape; /**< First emitter of each emitting shape*/
+    const EnvironmentMap *environment = nullptr; /**< Sampled environment*/
+    float environment_select = 0; /**< Probability of sampling environment*/
+
+    /***************************************************
+     * @brief Collects the emitters of the scene
+     * @param shapes Shapes of the scene, must outlive the list
+     * @param environment Environment map to sample, nullptr if none
+     ***************************************************/
+    void build(const std::vector<obj_pointer> &shapes,
+               const EnvironmentMap *environment = nullptr);
+
+    bool empty() const { return emitters.empty() && !environment; }
+
+    /***************************************************
+     * @brief Picks an emitter and samples a direction towards it
+     * @param from Point receiving the light
+     * @param sampler Source of the light sample
+     * @param out Sampled direction
+     * @return False if no direction could be sampled
+     ***************************************************/
+    bool sample(const Vec3 &from, Sampler &sampler, LightSample &out) const;
+
+    /***************************************************
+     * @brief Solid angle pdf of sample() reaching a point on a shape
+     * @param shape Shape that was hit
+     * @param from Point receiving the light
+     * @param point Point hit on the shape
+     * @param normal Surface normal at the hit point
+     * @return 0 if the shape is not in the list
+     ***************************************************/
+    float pdf(const AbstractShape *shape, const Vec3 &from, const Vec3 &point,
+              const Vec3 &normal) const;
+
+    /***************************************************
+     * @brief Solid angle pdf of sample() picking an escaping direction
+     * @return 0 if the environment is not sampled
+     ***************************************************/
+    float environment_pdf(const Vec3 &dir) const;
+};
+
+/***************************************************
+ * @brief Power heuristic weight for combining two sampling strategies
+ * @param pdf Pdf of the strategy that produced the sample
+ * @param other_pdf Pdf of the other strategy for the same sample
+ ***************************************************/
+static inline float mis_weight(float pdf, float other_pdf) {
+    float a = pdf * pdf, b = other_pdf * other_pdf;
+    return a + b > 0 ? a / (a + b) : 0;
+}
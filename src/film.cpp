@@ -0,0 +1,163 @@
+#include "film.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+
+/*************************************
+ * Checkpoint file signature and layout version
+ *************************************/
+static const char CHECKPOINT_MAGIC[8] = {'T', 'I', 'N', 'G', 'E', 'C', 'K', 'P'};
+constexpr uint32_t CHECKPOINT_VERSION = 3;
+
+// Pixels are written to checkpoints as raw memory
+static_assert(sizeof(Vec3) == 3 * sizeof(float), "Vec3 must be packed");
+static_assert(std::is_trivially_copyable<PixelStats>::value,
+              "PixelStats must be trivially copyable");
+
+/*************************************
+ * Header of a checkpoint file, followed by the radiance, stats, albedo,
+ * normal and depth of every pixel
+ *************************************/
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height;
+    uint32_t passes;
+    uint64_t seed;
+    uint32_t next_sample;
+    uint64_t settings;
+};
+
+void Film::reset(int width, int height, uint64_t seed, uint64_t settings) {
+    this->width = width;
+    this->height = height;
+    this->seed = seed;
+    this->settings = settings;
+    passes = 0;
+    next_sample = 0;
+    radiance.assign(size_t(width) * height, Vec3(0, 0, 0));
+    stats.assign(size_t(width) * height, PixelStats());
+    albedo.assign(size_t(width) * height, Vec3(0, 0, 0));
+    normal.assign(size_t(width) * height, Vec3(0, 0, 0));
+    depth.assign(size_t(width) * height, 0);
+}
+
+void Film::resolve(float *rgb) const {
+    for (size_t pix = 0; pix < radiance.size(); pix++) {
+        Vec3 c = stats[pix].n ? radiance[pix] / float(stats[pix].n) : Vec3();
+        rgb[pix * 3 + 0] = c.x;
+        rgb[pix * 3 + 1] = c.y;
+        rgb[pix * 3 + 2] = c.z;
+    }
+}
+
+void Film::resolve_features(float *albedo, float *normal, float *depth,
+                            float *variance) const {
+    for (size_t pix = 0; pix < radiance.size(); pix++) {
+        float inv_n = stats[pix].n ? 1.0f / stats[pix].n : 0;
+        Vec3 a = this->albedo[pix] * inv_n;
+        Vec3 n = this->normal[pix].normalized();
+        albedo[pix * 3 + 0] = a.x;
+        albedo[pix * 3 + 1] = a.y;
+        albedo[pix * 3 + 2] = a.z;
+        normal[pix * 3 + 0] = n.x;
+        normal[pix * 3 + 1] = n.y;
+        normal[pix * 3 + 2] = n.z;
+        depth[pix] = this->depth[pix] * inv_n;
+        variance[pix] = stats[pix].variance() * inv_n;
+    }
+}
+
+bool Film::save_checkpoint(const std::string &path) const {
+    // Zeroed so the padding written with the header is not left undefined
+    CheckpointHeader header{};
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.width = width;
+    header.height = height;
+    header.passes = passes;
+    header.seed = seed;
+    header.next_sample = next_sample;
+    header.settings = settings;
+
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(radiance.data()),
+                  radiance.size() * sizeof(Vec3));
+        out.write(reinterpret_cast<const char *>(stats.data()),
+                  stats.size() * sizeof(PixelStats));
+        out.write(reinterpret_cast<const char *>(albedo.data()),
+                  albedo.size() * sizeof(Vec3));
+        out.write(reinterpret_cast<const char *>(normal.data()),
+                  normal.size() * sizeof(Vec3));
+        out.write(reinterpret_cast<const char *>(depth.data()),
+                  depth.size() * sizeof(float));
+        if (!out)
+            return false;
+    }
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+bool Film::load_checkpoint(const std::string &path, int width, int height,
+                           uint64_t settings) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+
+    CheckpointHeader header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in ||
+        std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) ||
+        header.version != CHECKPOINT_VERSION) {
+        std::cerr << "[Film] " << path << " is not a checkpoint\n";
+        return false;
+    }
+    if (header.width != width || header.height != height) {
+        std::cerr << "[Film] Checkpoint " << path << " is " << header.width
+                  << "x" << header.height << ", not " << width << "x"
+                  << height << "\n";
+        return false;
+    }
+    if (header.settings != settings) {
+        std::cerr << "[Film] Checkpoint " << path
+                  << " was rendered with another scene or settings\n";
+        return false;
+    }
+
+    std::vector<Vec3> loaded_radiance(size_t(width) * height);
+    std::vector<PixelStats> loaded_stats(size_t(width) * height);
+    std::vector<Vec3> loaded_albedo(size_t(width) * height);
+    std::vector<Vec3> loaded_normal(size_t(width) * height);
+    std::vector<float> loaded_depth(size_t(width) * height);
+    in.read(reinterpret_cast<char *>(loaded_radiance.data()),
+            loaded_radiance.size() * sizeof(Vec3));
+    in.read(reinterpret_cast<char *>(loaded_stats.data()),
+            loaded_stats.size() * sizeof(PixelStats));
+    in.read(reinterpret_cast<char *>(loaded_albedo.data()),
+            loaded_albedo.size() * sizeof(Vec3));
+    in.read(reinterpret_cast<char *>(loaded_normal.data()),
+            loaded_normal.size() * sizeof(Vec3));
+    in.read(reinterpret_cast<char *>(loaded_depth.data()),
+            loaded_depth.size() * sizeof(float));
+    if (!in) {
+        std::cerr << "[Film] Checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    this->width = width;
+    this->height = height;
+    seed = header.seed;
+    this->settings = settings;
+    passes = header.passes;
+    next_sample = header.next_sample;
+    radiance = std::move(loaded_radiance);
+    stats = std::move(loaded_stats);
+    albedo = std::move(loaded_albedo);
+    normal = std::move(loaded_normal);
+    depth = std::move(loaded_depth);
+    return true;
+}
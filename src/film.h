@@ -0,0 +1,105 @@
+#pragma once
+
+#include "math.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*************************************
+ * Luminance below which a pixel counts as black when its relative error is
+ * estimated, so dark pixels do not sample forever
+ *************************************/
+constexpr float ADAPTIVE_MIN_MEAN = 1e-2f;
+
+/*************************************
+ * Running mean and variance of the luminance of a pixel's samples, updated
+ * with Welford's algorithm
+ *************************************/
+struct PixelStats {
+    int n = 0;      /**< Samples taken*/
+    float mean = 0; /**< Mean luminance*/
+    float m2 = 0;   /**< Sum of squared deviations from the mean*/
+
+    void add(float x) {
+        n++;
+        float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    /*************************************
+     * @brief Unbiased sample variance
+     *************************************/
+    float variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+
+    /*************************************
+     * @brief Standard error of the mean relative to the mean
+     * @param min_variance Lower bound on the variance used
+     *************************************/
+    float relative_error(float min_variance) const {
+        if (n < 2)
+            return INFINITY;
+        float std_error = std::sqrt(std::max(variance(), min_variance) / n);
+        return std_error / std::max(mean, ADAPTIVE_MIN_MEAN);
+    }
+};
+
+/*************************************
+ * Radiance accumulated over the passes of a render, along with what a later
+ * run needs to resume it from a checkpoint
+ *************************************/
+struct Film {
+    int width = 0, height = 0;
+    std::vector<Vec3> radiance;    /**< Sum of the samples of each pixel*/
+    std::vector<PixelStats> stats; /**< Samples taken by each pixel*/
+    std::vector<Vec3> albedo;      /**< Sum of first hit albedos*/
+    std::vector<Vec3> normal;      /**< Sum of first hit world normals*/
+    std::vector<float> depth;      /**< Sum of first hit distances*/
+    uint64_t seed = 0;        /**< Seed the stream of every sample derives from*/
+    uint64_t settings = 0;    /**< Hash of the scene and settings the samples
+                                   were taken with*/
+    uint32_t passes = 0;      /**< Passes completed*/
+    uint32_t next_sample = 0; /**< First sample index of the next pass*/
+
+    /***************************************************
+     * @brief Clears the film for a new render
+     ***************************************************/
+    void reset(int width, int height, uint64_t seed, uint64_t settings);
+
+    /***************************************************
+     * @brief Averages the samples of each pixel into linear float RGB,
+     * pixels without samples are black
+     * @param rgb Output, three floats per pixel
+     ***************************************************/
+    void resolve(float *rgb) const;
+
+    /***************************************************
+     * @brief Averages the first hit features of each pixel for the denoiser
+     * @param albedo Output, three floats per pixel
+     * @param normal Output, three floats per pixel, normalized
+     * @param depth Output, one float per pixel
+     * @param variance Output, variance of the mean luminance of each pixel
+     ***************************************************/
+    void resolve_features(float *albedo, float *normal, float *depth,
+                          float *variance) const;
+
+    /***************************************************
+     * @brief Writes the film to a checkpoint file
+     * The file is written next to the path and renamed over it, so a run
+     * killed while saving leaves the previous checkpoint intact.
+     * @return False if the file could not be written
+     ***************************************************/
+    bool save_checkpoint(const std::string &path) const;
+
+    /***************************************************
+     * @brief Reads a checkpoint written by save_checkpoint()
+     * @param width Expected width of the film
+     * @param height Expected height of the film
+     * @param settings Expected hash of the scene and render settings
+     * @return False if the file is missing, corrupt, of another size or
+     * rendered with other settings, the film is left untouched then
+     ***************************************************/
+    bool load_checkpoint(const std::string &path, int width, int height,
+                         uint64_t settings);
+};
@@ -0,0 +1,226 @@
+#include "image.h"
+#include "simd.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include <stb_image/stb_image_write.h>
+
+// PFM and OpenEXR store little endian floats, written straight from memory
+// on the little endian hosts tinge runs on
+
+/***************************************************
+ * @brief Lower case extension of a path, including the dot
+ ***************************************************/
+static std::string extension(const std::string &path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return "";
+    std::string ext = path.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return ext;
+}
+
+bool is_hdr_image(const std::string &path) {
+    std::string ext = extension(path);
+    return ext == ".hdr" || ext == ".pfm" || ext == ".exr";
+}
+
+/***************************************************
+ * @brief Runs fn(first_row, last_row) over bands of rows on several threads
+ ***************************************************/
+template <typename F>
+static void parallel_rows(int height, unsigned int num_threads, F fn) {
+    int bands = std::max(1, std::min<int>(num_threads, height));
+    std::vector<std::thread> threads;
+    threads.reserve(bands - 1);
+    for (int b = 0; b < bands; b++) {
+        int y0 = int(int64_t(height) * b / bands);
+        int y1 = int(int64_t(height) * (b + 1) / bands);
+        if (b == bands - 1)
+            fn(y0, y1);
+        else
+            threads.emplace_back(fn, y0, y1);
+    }
+    for (std::thread &t : threads)
+        t.join();
+}
+
+/*************************************
+ * Entries of the transfer function lookup tables, fine enough that a step
+ * is under one 8-bit level even where the 1/1.8 gamma is steepest
+ *************************************/
+constexpr int TRANSFER_LUT_SIZE = 1 << 16;
+
+/***************************************************
+ * @brief Lookup table taking [0, 1] in TRANSFER_LUT_SIZE steps to 8-bit
+ ***************************************************/
+static std::vector<unsigned char> build_transfer_lut(bool srgb) {
+    std::vector<unsigned char> lut(TRANSFER_LUT_SIZE);
+    for (int i = 0; i < TRANSFER_LUT_SIZE; i++) {
+        float c = float(i) / (TRANSFER_LUT_SIZE - 1);
+        if (srgb)
+            lut[i] = (unsigned char)(255 * (c <= 0.0031308f
+                                                ? 12.92f * c
+                                                : 1.055f * pow(c, 1 / 2.4) -
+                                                      0.055f) +
+                                     0.5f);
+        else
+            lut[i] = (unsigned char)(255 * pow(c, 1 / 1.8));
+    }
+    return lut;
+}
+
+/***************************************************
+ * @brief Applies a tone curve to four channels, the result lies in [0, 1]
+ ***************************************************/
+static inline Float4 tone_curve(Float4 x, ToneMap curve) {
+    const Float4 zero(0.0f), one(1.0f);
+    x = f4_max(x, zero);
+    if (curve == ToneMap::Reinhard) {
+        x = x / (one + x);
+    } else if (curve == ToneMap::ACES) {
+        x = x * (Float4(2.51f) * x + Float4(0.03f)) /
+            (x * (Float4(2.43f) * x + Float4(0.59f)) + Float4(0.14f));
+    }
+    return f4_min(x, one);
+}
+
+void tonemap(const float *rgb, unsigned char *data, int width, int height,
+             ToneMap curve, unsigned int num_threads) {
+    static const std::vector<unsigned char> gamma_lut = build_transfer_lut(false);
+    static const std::vector<unsigned char> srgb_lut = build_transfer_lut(true);
+    const unsigned char *lut =
+        curve == ToneMap::Gamma ? gamma_lut.data() : srgb_lut.data();
+
+    parallel_rows(height, num_threads, [&](int y0, int y1) {
+        size_t first = size_t(y0) * width * 3, last = size_t(y1) * width * 3;
+        const Float4 scale(float(TRANSFER_LUT_SIZE - 1));
+        int index[4];
+        size_t i = first;
+        for (; i + 4 <= last; i += 4) {
+            f4_store_int(index, tone_curve(f4_loadu(rgb + i), curve) * scale);
+            for (int k = 0; k < 4; k++)
+                data[i + k] = lut[index[k]];
+        }
+
+        // Up to three channels are left over when the band is not a
+        // multiple of four
+        float tail[4] = {0, 0, 0, 0};
+        std::copy(rgb + i, rgb + last, tail);
+        f4_store_int(index, tone_curve(f4_loadu(tail), curve) * scale);
+        for (int k = 0; i + k < last; k++)
+            data[i + k] = lut[index[k]];
+    });
+}
+
+bool write_hdr_image(const std::string &path, const float *rgb, int width,
+                     int height) {
+    std::string ext = extension(path);
+    if (ext == ".hdr")
+        return stbi_write_hdr(path.c_str(), width, height, 3, rgb) != 0;
+    if (ext == ".pfm")
+        return write_pfm(path, rgb, width, height);
+    if (ext == ".exr")
+        return write_exr(path, rgb, width, height);
+    return false;
+}
+
+bool write_pfm(const std::string &path, const float *rgb, int width,
+               int height) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+    // A negative scale marks little endian data, rows go bottom to top
+    out << "PF\n" << width << " " << height << "\n-1.0\n";
+    for (int y = height - 1; y >= 0; y--)
+        out.write(reinterpret_cast<const char *>(rgb + size_t(y) * width * 3),
+                  size_t(width) * 3 * sizeof(float));
+    return bool(out);
+}
+
+/***************************************************
+ * Builds an OpenEXR header in memory
+ ***************************************************/
+struct ExrWriter {
+    std::vector<char> bytes;
+
+    template <typename T> void put(const T &value) {
+        const char *p = reinterpret_cast<const char *>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    void put_string(const char *s) { bytes.insert(bytes.end(), s, s + strlen(s) + 1); }
+
+    void attribute(const char *name, const char *type, int32_t size) {
+        put_string(name);
+        put_string(type);
+        put(size);
+    }
+};
+
+bool write_exr(const std::string &path, const float *rgb, int width,
+               int height) {
+    constexpr int32_t EXR_FLOAT = 2;
+    // Channels are stored in alphabetical order, one row of each per line
+    const char *channels[3] = {"B", "G", "R"};
+    const int channel_offset[3] = {2, 1, 0};
+
+    ExrWriter header;
+    header.put(int32_t(20000630)); // Magic number
+    header.put(int32_t(2));        // Version 2, single part scanline file
+
+    header.attribute("channels", "chlist", 3 * 18 + 1);
+    for (const char *channel : channels) {
+        header.put_string(channel);
+        header.put(EXR_FLOAT);
+        header.put(int32_t(0)); // pLinear and reserved bytes
+        header.put(int32_t(1)); // x sampling
+        header.put(int32_t(1)); // y sampling
+    }
+    header.put(char(0));
+
+    header.attribute("compression", "compression", 1);
+    header.put(char(0)); // NO_COMPRESSION
+    int32_t window[4] = {0, 0, width - 1, height - 1};
+    header.attribute("dataWindow", "box2i", sizeof(window));
+    header.put(window);
+    header.attribute("displayWindow", "box2i", sizeof(window));
+    header.put(window);
+    header.attribute("lineOrder", "lineOrder", 1);
+    header.put(char(0)); // INCREASING_Y
+    header.attribute("pixelAspectRatio", "float", 4);
+    header.put(1.0f);
+    header.attribute("screenWindowCenter", "v2f", 8);
+    header.put(0.0f);
+    header.put(0.0f);
+    header.attribute("screenWindowWidth", "float", 4);
+    header.put(1.0f);
+    header.put(char(0)); // End of header
+
+    // Offset table, one uncompressed line per chunk
+    int32_t line_size = int32_t(3 * width * sizeof(float));
+    uint64_t chunk_start = header.bytes.size() + size_t(height) * sizeof(uint64_t);
+    for (int y = 0; y < height; y++)
+        header.put(uint64_t(chunk_start + uint64_t(y) * (8 + line_size)));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(header.bytes.data(), header.bytes.size());
+
+    std::vector<float> line(size_t(width) * 3);
+    for (int32_t y = 0; y < height; y++) {
+        const float *row = rgb + size_t(y) * width * 3;
+        for (int c = 0; c < 3; c++)
+            for (int x = 0; x < width; x++)
+                line[size_t(c) * width + x] = row[x * 3 + channel_offset[c]];
+        out.write(reinterpret_cast<const char *>(&y), sizeof(y));
+        out.write(reinterpret_cast<const char *>(&line_size), sizeof(line_size));
+        out.write(reinterpret_cast<const char *>(line.data()), line_size);
+    }
+    return bool(out);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/***************************************************
+ * @brief Whether a file keeps linear radiance, from its extension
+ * @return True for .hdr, .pfm and .exr files
+ ***************************************************/
+bool is_hdr_image(const std::string &path);
+
+/***********************************
+ * Curves mapping linear radiance to displayable 8-bit colour
+ ***********************************/
+enum struct ToneMap {
+    Gamma,    /**< Clamp to [0, 1] and apply a 1/1.8 gamma*/
+    SRGB,     /**< Clamp to [0, 1] and apply the sRGB transfer function*/
+    Reinhard, /**< Reinhard x / (1 + x) per channel, then sRGB*/
+    ACES      /**< Narkowicz fit of the ACES filmic curve, then sRGB*/
+};
+
+/***************************************************
+ * @brief Maps linear RGB to 8-bit RGB
+ * The curve runs four channels at a time and the transfer function is
+ * read from a lookup table, rows are split across threads.
+ * @param rgb Linear RGB, three floats per pixel
+ * @param data Output, three bytes per pixel
+ ***************************************************/
+void tonemap(const float *rgb, unsigned char *data, int width, int height,
+             ToneMap curve, unsigned int num_threads);
+
+/***************************************************
+ * @brief Writes linear RGB as a Radiance .hdr, PFM or OpenEXR file
+ * The format is picked from the extension of the path.
+ * @param rgb Linear RGB, three floats per pixel, top row first
+ * @return False if the format is unknown or the file could not be written
+ ***************************************************/
+bool write_hdr_image(const std::string &path, const float *rgb, int width,
+                     int height);
+
+/***************************************************
+ * @brief Writes linear RGB as a little endian colour PFM
+ * @param rgb Linear RGB, three floats per pixel, top row first
+ ***************************************************/
+bool write_pfm(const std::string &path, const float *rgb, int width,
+               int height);
+
+/***************************************************
+ * @brief Writes linear RGB as an uncompressed scanline OpenEXR file with
+ * 32-bit float channels
+ * @param rgb Linear RGB, three floats per pixel, top row first
+ ***************************************************/
+bool write_exr(const std::string &path, const float *rgb, int width,
+               int height);
@@ -0,0 +1,80 @@
+#include "mapped_file.h"
+#include "random.h"
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TINGE_HAS_MMAP 1
+#endif
+
+MappedFile::~MappedFile() { close(); }
+
+bool MappedFile::open(const std::string &path) {
+    close();
+#ifdef TINGE_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+    length = size_t(info.st_size);
+    if (length > 0) {
+        void *view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = static_cast<const char *>(view);
+            mapped = true;
+        }
+    }
+    ::close(fd);
+    if (mapped || length == 0) {
+        bytes = mapped ? bytes : buffer.data();
+        return true;
+    }
+#endif
+    // Read the file into memory where it cannot be mapped
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+    buffer.resize(size_t(in.tellg()));
+    in.seekg(0);
+    in.read(buffer.data(), buffer.size());
+    if (!in) {
+        buffer.clear();
+        return false;
+    }
+    bytes = buffer.data();
+    length = buffer.size();
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef TINGE_HAS_MMAP
+    if (mapped)
+        munmap(const_cast<char *>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+    mapped = false;
+    buffer.clear();
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+    const char *p = static_cast<const char *>(data);
+    uint64_t h = mix64(seed ^ size);
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        h = (h ^ (word * 0x87C37B91114253D5ull)) * 0x9E3779B97F4A7C15ull;
+        h = (h << 31) | (h >> 33);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, size);
+    return mix64(h ^ tail);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/***********************************
+ * Read only view of a whole file
+ * The file is memory mapped where the platform allows it, so pages are
+ * only read as they are touched, and read into memory elsewhere.
+ ***********************************/
+class MappedFile {
+  private:
+    const char *bytes = nullptr; /**< Start of the file contents*/
+    size_t length = 0;           /**< Size of the file in bytes*/
+    bool mapped = false;         /**< Whether bytes is a mapping*/
+    std::vector<char> buffer;    /**< Contents when the file is not mapped*/
+
+  public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    /***************************************************
+     * @brief Maps a file, replacing the one mapped before
+     * @return False if the file could not be opened
+     ***************************************************/
+    bool open(const std::string &path);
+
+    /***************************************************
+     * @brief Unmaps the file
+     ***************************************************/
+    void close();
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+/***************************************************
+ * @brief 64-bit hash of a block of memory, eight bytes at a time
+ * Meant for noticing changed files, not for hash tables or security.
+ * @param seed Hash to continue from, so several blocks can be chained
+ ***************************************************/
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0);
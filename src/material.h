@@ -2,7 +2,7 @@
 #include "camera.h"
 #include "iostream"
 #include "math.h"
-#include "random.h"
+#include "sampler.h"
 #include "util.h"
 #include <algorithm>
 #include <cmath>
@@ -31,10 +31,33 @@ class AbstractMaterial {
      * @param wo the incoming ray direction
      * @param at the point of incidence of the reflection, implemented to prevent floating point errors
      * @param n the normal of the object
-     * @param random_gen random number generator 
+     * @param sampler source of the sample 
      * @return Returns the direction vector of the light reflected
      ***********************************/
-    virtual Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Random &r) = 0;
+    virtual Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Sampler &r) = 0;
+    /***********************************
+     * @brief Samples a reflected direction and reports its pdf, used to weigh it against light sampling
+     * @param pdf solid angle pdf of the returned direction, 0 if it was picked from a delta lobe
+     * @return Returns the direction vector of the light reflected
+     ***********************************/
+    virtual Ray sample_wi(const Ray &wo, const Vec3 &at, const Vec3 &n, Sampler &r, float &pdf) {
+        pdf = 0;
+        return sample_wi(wo, at, n, r);
+    }
+    /***********************************
+     * @brief BRDF times cosine towards a light sampled direction
+     * @return Zero for materials that only scatter into delta directions
+     ***********************************/
+    virtual Vec3 eval(const Ray &wi, const Ray &wo, Vec3 n) const { return Vec3(0, 0, 0); }
+    /***********************************
+     * @brief Solid angle pdf of sample_wi picking the direction wi
+     * @return Zero for materials that only scatter into delta directions
+     ***********************************/
+    virtual float pdf(const Ray &wi, const Ray &wo, Vec3 n) const { return 0; }
+    /***********************************
+     * @brief Whether the material emits light and belongs in the emitter list
+     ***********************************/
+    virtual bool is_emissive() const { return false; }
 };
 
 /***********************************
@@ -69,12 +92,29 @@ class MaterialDiffuse : public AbstractMaterial {
      * @param wo the incoming ray direction
      * @param at the point of incidence of the reflection, implemented to prevent floating point errors
      * @param n the normal of the object
-     * @param random_gen random number generator 
+     * @param sampler source of the sample 
      * @return A object of the Ray class pointing in a random direction chosen from the hemisphere in the outward direction of the object
      ***********************************/
 
-    Ray sample_wi(const Ray &wo, const Vec3& at,const Vec3 &n, Random &random_gen) override {
-        return Ray(at + n * 1e-4f, random_gen.GenerateCosinePointHemisphere(n));
+    Ray sample_wi(const Ray &wo, const Vec3& at,const Vec3 &n, Sampler &sampler) override {
+        return Ray(at + n * 1e-4f, sampler.GenerateCosinePointHemisphere(n));
+    }
+    Ray sample_wi(const Ray &wo, const Vec3 &at, const Vec3 &n, Sampler &sampler, float &pdf) override {
+        Ray wi = sample_wi(wo, at, n, sampler);
+        pdf = this->pdf(wi, wo, n);
+        return wi;
+    }
+    /***********************************
+     * @brief Lambertian BRDF times cosine
+     ***********************************/
+    Vec3 eval(const Ray &wi, const Ray &wo, Vec3 n) const override {
+        return color * (std::max(0.0f, dot(wi.direction, n)) / M_PI);
+    }
+    /***********************************
+     * @brief Pdf of the cosine weighted hemisphere sampling
+     ***********************************/
+    float pdf(const Ray &wi, const Ray &wo, Vec3 n) const override {
+        return std::max(0.0f, dot(wi.direction, n)) / M_PI;
     }
 };
 /***********************************
@@ -108,12 +148,15 @@ class MaterialEmissive : public AbstractMaterial {
      * @param wo the incoming ray direction
      * @param at the point of incidence of the reflection, implemented to prevent floating point errors
      * @param n the normal of the object
-     * @param random_gen random number generator 
+     * @param sampler source of the sample 
      * @return Ray object of origin 0 and direction 0 as no light reflected
      ***********************************/
-    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Random &random_gen) override {
+    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Sampler & /*sampler*/) override {
         return Ray(0, Vec3(0,0,0));
     }
+    bool is_emissive() const override {
+        return intensity > 0 && !(color == Vec3(0, 0, 0));
+    }
 };
 /***********************************
  * A class for Metallic Material and its BRDF which means the material is assumed to emit no light of its own, and has a probability p to behave as diffuse and otherwise as a purely reflective material
@@ -148,16 +191,37 @@ class MaterialMetallic : public AbstractMaterial {
      * @param wo the incoming ray direction
      * @param at the point of incidence of the reflection, implemented to prevent floating point errors
      * @param n the normal of the object
-     * @param random_gen random number generator 
+     * @param sampler source of the sample 
      * @return Either a normal reflected ray or a diffuse reflected ray depending upon the random number generated
      ***********************************/
     // Diffuse with probability p
-    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Random &random_gen) override {
-        if (random_gen.GenerateUniformFloat() < p)
-            return Ray(at + n * 1e-4f, random_gen.GenerateCosinePointHemisphere(n));
+    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Sampler &sampler) override {
+        if (sampler.get_1d() < p)
+            return Ray(at + n * 1e-4f, sampler.GenerateCosinePointHemisphere(n));
         else
             return reflect(wo, at, n);
     }
+    Ray sample_wi(const Ray &wo, const Vec3 &at, const Vec3 &n, Sampler &sampler, float &pdf) override {
+        if (sampler.get_1d() < p) {
+            Ray wi(at + n * 1e-4f, sampler.GenerateCosinePointHemisphere(n));
+            pdf = this->pdf(wi, wo, n);
+            return wi;
+        }
+        pdf = 0;
+        return reflect(wo, at, n);
+    }
+    /***********************************
+     * @brief Diffuse lobe BRDF times cosine, the mirror lobe cannot be light sampled
+     ***********************************/
+    Vec3 eval(const Ray &wi, const Ray &wo, Vec3 n) const override {
+        return color * (p * std::max(0.0f, dot(wi.direction, n)) / M_PI);
+    }
+    /***********************************
+     * @brief Pdf of picking wi through the diffuse lobe
+     ***********************************/
+    float pdf(const Ray &wi, const Ray &wo, Vec3 n) const override {
+        return p * std::max(0.0f, dot(wi.direction, n)) / M_PI;
+    }
 };
 /***********************************
  * A class for Transmissive Material, it emits no light, purely transmissive material NOT considering Schlick's approximation with partial reflection
@@ -191,10 +255,10 @@ class MaterialTransmission : public AbstractMaterial {
      * @param wo the incoming ray direction
      * @param at the point of incidence of the reflection, implemented to prevent floating point errors
      * @param n the normal of the object
-     * @param random_gen random number generator 
+     * @param sampler source of the sample 
      * @return The direction of the ray reflected
      ***********************************/
-    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Random &random_gen) override {
+    Ray sample_wi(const Ray &wo, const Vec3& at, const Vec3 &n, Sampler &sampler) override {
         float etai_over_etat = 1/mu;
         Vec3 outward_normal = n;
 
@@ -206,7 +270,7 @@ class MaterialTransmission : public AbstractMaterial {
         
         float p = fresnel(dot(wo.direction, -outward_normal), mu);
         
-        if (random_gen.GenerateUniformFloat() < p)
+        if (sampler.get_1d() < p)
             return reflect(wo, at, outward_normal);
 
         return refract(wo, at, outward_normal, etai_over_etat);
@@ -302,14 +366,14 @@ class MaterialDielectric : public AbstractMaterial {
          * @param wo the incoming ray direction
          * @param at the point of incidence of the reflection, implemented to prevent floating point errors
          * @param n the normal of the object
-         * @param random_gen random number generator 
+         * @param sampler source of the sample 
          * @return The direction of the ray reflected
          ***********************************/
-        Ray sample_wi(const Ray &wo, const Vec3 &at, const Vec3 &n, Random &random_gen) override {
+        Ray sample_wi(const Ray &wo, const Vec3 &at, const Vec3 &n, Sampler &sampler) override {
             float cos_theta = clamp(dot(wo.direction, n), -1.0f, 1.0f);
             float F = Fresnel(fabs(cos_theta), refractive_index);
 
-            if (random_gen.GenerateUniformFloat() < F) {
+            if (sampler.get_1d() < F) {
                 // Reflect the ray
                 return reflect(wo, at, n);
             } else {
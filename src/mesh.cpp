@@ -1,114 +1,183 @@
 
 #include "mesh.h"
 #include "bvh.h"
-#include "obj_loader/OBJ_Loader.h"
+#include "emitters.h"
+#include "mapped_file.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
 #include "objects.h"
+#include <array>
+#include <exception>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <tuple>
 #include <utility>
 #include <vector>
 
-Mesh::Mesh(const std::string &fname, mat_pointer material, Vec3 origin,
-           Vec3 scale, Vec3 rotation, int bvh_height) {
-    type = MeshObject;
-    root = std::make_unique<BVH_Node>();
-    this->material = material;
-
+MeshData::MeshData(const std::string &fname, const Frame &f, int bvh_height,
+                   BVH_Split bvh_split) {
     std::cout << "[Mesh Loader] Loading mesh '" << fname << "'" << std::endl;
-    objl::Loader Loader;
-    bool loadout = Loader.LoadFile(fname);
-    Frame f;
-    f.origin = origin;
-    f.rotation = rotation;
-    f.scale = scale;
-    f.lockFrame();
 
-    for (const auto &loaded_mesh : Loader.LoadedMeshes) {
-        /*objl::Mesh loaded_mesh = Loader.LoadedMeshes[0];*/
-        for (int i = 0; i < loaded_mesh.Indices.size(); i += 3) {
-            auto &v1 = loaded_mesh.Vertices[loaded_mesh.Indices[i]].Position;
-            auto &v2 =
-                loaded_mesh.Vertices[loaded_mesh.Indices[i + 1]].Position;
-            auto &v3 =
-                loaded_mesh.Vertices[loaded_mesh.Indices[i + 2]].Position;
-            std::unique_ptr<Triangle> triangle = std::make_unique<Triangle>(
-                f.frameToWorld * Vec3(v1.X, v1.Y, v1.Z),
-                f.frameToWorld * Vec3(v2.X, v2.Y, v2.Z),
-                f.frameToWorld * Vec3(v3.X, v3.Y, v3.Z), material);
-            triangle->type = MeshTriangle;
-
-            root->volume.expand(triangle->centre);
-            root->triangles.push_back(std::move(triangle));
-        }
+    // A cache is only reused for the same file contents, frame and BVH
+    // settings
+    MappedFile source;
+    uint64_t source_hash = 0, key = 0;
+    if (source.open(fname)) {
+        float frame[9] = {f.origin.x,   f.origin.y,   f.origin.z,
+                          f.scale.x,    f.scale.y,    f.scale.z,
+                          f.rotation.x, f.rotation.y, f.rotation.z};
+        int32_t build[2] = {bvh_height, int32_t(bvh_split)};
+        source_hash = hash_bytes(source.data(), source.size());
+        key = hash_bytes(frame, sizeof(frame), source_hash);
+        key = hash_bytes(build, sizeof(build), key);
+    } else
+        std::cerr << "[Mesh Loader] Could not open '" << fname << "'"
+                  << std::endl;
+    std::string cache_file = mesh_cache_path(fname, key);
+
+    if (key && load_mesh_cache(cache_file, key, bvh)) {
+        std::cout << "[Mesh Cache] Loaded " << bvh.triangle_count()
+                  << " triangles and " << bvh.nodes.size()
+                  << " wide nodes from '" << cache_file << "'" << std::endl;
+        return;
+    }
+
+    // The file is parsed straight from the mapping used for the key
+    ObjMesh obj;
+    bool loadout = key && parse_obj(source.data(), source.size(), obj);
+    source.close();
+
+    // Vertices are moved into the frame once and shared by the triangles
+    bvh.vertices = std::move(obj.positions);
+    for (Vec3 &vertex : bvh.vertices)
+        vertex = f.frameToWorld * vertex;
+    bvh.triangles = std::move(obj.position_indices);
+
+    std::unique_ptr<BVH_Node> root = std::make_unique<BVH_Node>();
+    std::vector<BVH_Volume> bounds(bvh.triangle_count());
+    root->primitives.reserve(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        bounds[i] = bvh.triangle_bounds(i);
+        root->volume.expand(bounds[i].min);
+        root->volume.expand(bounds[i].max);
+        root->primitives.push_back(i);
     }
 
     std::cout << "[BVH] Constructed mesh bounds " << root->volume.min << root->volume.max << std::endl;
-    split(root, bvh_height);
+    if (bvh_split == BVH_Split::SAH)
+        split_sah(root, bounds, 16, TRIANGLE_BLOCK_SIZE);
+    else
+        split(root, bvh_height, bvh);
+    bvh.flatten(root);
+    std::cout << "[BVH] Collapsed into " << bvh.nodes.size()
+              << " wide nodes, duplication factor " << bvh.duplication_factor()
+              << std::endl;
+
+    if (key && loadout) {
+        if (save_mesh_cache(cache_file, key, source_hash, bvh))
+            remove_stale_mesh_caches(fname, source_hash);
+        else
+            std::cerr << "[Mesh Cache] Failed to write '" << cache_file << "'"
+                      << std::endl;
+    }
     std::cout << "[Mesh Loader] Finished loading." << std::endl;
 }
 
-bool traverse(const std::unique_ptr<BVH_Node> &root, const Ray &ray,
-              IntersectionOut &intsec_out) {
-    if (!root->volume.intersect(ray))
-        return false;
-    if (root->childA == nullptr && root->childB == nullptr) {
-        for (const auto &i : root->triangles) {
-            IntersectionOut ans = i->intersect(ray);
-            if (ans.hit) {
-                if (ans.t < intsec_out.t) {
-                    intsec_out = ans;
-                }
-            }
-        }
-
-        return intsec_out.hit;
-    } else {
-        float h1_ = root->childA->volume.heuristic_intersect(ray);
-        float h2_ = root->childA->volume.heuristic_intersect(ray);
-
-        // If both box collisions are close check both else check closer first
-        if (abs(h1_ - h2_) < 1e-5) {
-            IntersectionOut a, b;
-            bool h1 = traverse(root->childA, ray, a);
-            bool h2 = traverse(root->childB, ray, b);
-
-            if (h1 && h2) {
-                if (a.t < b.t)
-                    intsec_out = a;
-                else
-                    intsec_out = b;
-                return true;
-            }
-
-            if (h1) {
-                intsec_out = a;
-                return true;
-            }
-
-            if (h2) {
-                intsec_out = b;
-                return true;
-            }
-
-            return false;
-        } else if (h1_ > 0 && h1_ < h2_) {
-            if (traverse(root->childA, ray, intsec_out))
-                return true;
-            return traverse(root->childB, ray, intsec_out);
-        } else if (h2_ > 0 && h2_ < h1_) {
-            if (traverse(root->childB, ray, intsec_out))
-                return true;
-            return traverse(root->childA, ray, intsec_out);
-        }
-        return false;
+std::shared_ptr<const MeshData>
+MeshData::get(const std::string &fname, int bvh_height, BVH_Split bvh_split) {
+    Frame identity;
+    identity.lockFrame();
+    return get(fname, identity, bvh_height, bvh_split);
+}
+
+std::shared_ptr<const MeshData> MeshData::get(const std::string &fname,
+                                              const Frame &frame,
+                                              int bvh_height,
+                                              BVH_Split bvh_split) {
+    // Loaded data expires with the last shape holding it, a load in progress
+    // is shared with every caller asking for the same key meanwhile
+    struct Entry {
+        std::weak_ptr<const MeshData> data;
+        std::shared_future<std::shared_ptr<const MeshData>> loading;
+    };
+    static std::mutex registry_mutex;
+    static std::map<
+        std::tuple<std::string, std::array<float, 9>, int, BVH_Split>, Entry>
+        registry;
+
+    // Only the lookup holds the lock, different meshes load at the same time
+    std::unique_lock<std::mutex> lock(registry_mutex);
+
+    // Entries whose data expired with no load in flight are dropped, so the
+    // registry only holds meshes still in use
+    for (auto it = registry.begin(); it != registry.end();) {
+        if (it->second.data.expired() && !it->second.loading.valid())
+            it = registry.erase(it);
+        else
+            ++it;
+    }
+
+    std::array<float, 9> placement = {
+        frame.origin.x,   frame.origin.y,   frame.origin.z,
+        frame.scale.x,    frame.scale.y,    frame.scale.z,
+        frame.rotation.x, frame.rotation.y, frame.rotation.z};
+    Entry &entry =
+        registry[std::make_tuple(fname, placement, bvh_height, bvh_split)];
+    if (std::shared_ptr<const MeshData> data = entry.data.lock())
+        return data;
+    if (entry.loading.valid()) {
+        std::shared_future<std::shared_ptr<const MeshData>> loading =
+            entry.loading;
+        lock.unlock();
+        return loading.get();
     }
+    std::promise<std::shared_ptr<const MeshData>> loaded;
+    entry.loading = loaded.get_future().share();
+    lock.unlock();
+
+    std::shared_ptr<const MeshData> data;
+    try {
+        data = std::make_shared<const MeshData>(fname, frame, bvh_height,
+                                                bvh_split);
+    } catch (...) {
+        // Waiting callers get the error, later calls try loading again
+        lock.lock();
+        entry.loading = {};
+        lock.unlock();
+        loaded.set_exception(std::current_exception());
+        throw;
+    }
+
+    // The registry keeps only the weak pointer, so the data can expire
+    lock.lock();
+    entry.data = data;
+    entry.loading = {};
+    lock.unlock();
+    loaded.set_value(data);
+    return data;
+}
+
+Mesh::Mesh(const std::string &fname, mat_pointer material, Vec3 origin,
+           Vec3 scale, Vec3 rotation, int bvh_height, BVH_Split bvh_split) {
+    type = MeshObject;
+    this->material = material;
+
+    Frame f;
+    f.origin = origin;
+    f.rotation = rotation;
+    f.scale = scale;
+    f.lockFrame();
+    data = MeshData::get(fname, f, bvh_height, bvh_split);
 }
 
 bool Mesh::_intersect(const Ray &ray, IntersectionOut &intsec_out) {
     IntersectionOut min_hit;
     min_hit.t = TINGE_INFINITY;
     min_hit.hit = false;
-    bool hit = traverse(root, ray, min_hit);
+    bool hit = data->bvh.intersect(ray, min_hit);
     if (hit) {
         intsec_out = min_hit;
         return true;
@@ -116,4 +185,114 @@ bool Mesh::_intersect(const Ray &ray, IntersectionOut &intsec_out) {
     return false;
 }
 
+void Mesh::intersect_packet(const RayPacket &packet, int lanes,
+                            IntersectionOut out[4]) {
+    Float4 t_hit;
+    uint32_t hit_triangle[4];
+    int hits = data->bvh.intersect_packet(packet, lanes, t_hit, hit_triangle);
+
+    for (int i = 0; i < 4; i++) {
+        if (!(lanes & (1 << i)))
+            continue;
+        out[i] = IntersectionOut();
+        if (!(hits & (1 << i)))
+            continue;
+        const Ray &ray = packet.rays[i];
+        out[i].hit = true;
+        out[i].t = t_hit[i];
+        out[i].point = ray.at(t_hit[i]);
+        out[i].normal = data->bvh.normal(hit_triangle[i]);
+        out[i].hit_mat = material.get();
+        out[i].w0 = ray;
+    }
+}
+
+// Mesh triangles are already stored in world space
+void Mesh::get_emitters(std::vector<Emitter> &emitters) {
+    if (!material->is_emissive())
+        return;
+    const BVH &bvh = data->bvh;
+    for (uint32_t i = 0; i < bvh.triangle_count(); i++)
+        emitters.push_back(Emitter::triangle(bvh.vertex(i, 0), bvh.vertex(i, 1),
+                                             bvh.vertex(i, 2), material.get(),
+                                             this));
+}
+
 Vec3 Mesh::_get_normal(const Vec3 &point) { return Vec3(0, 0, 0); }
+
+// An empty mesh has an inverted box and is left out of the scene BVH
+bool Mesh::_get_bounds(Vec3 &min, Vec3 &max) {
+    min = data->bvh.bounds.min;
+    max = data->bvh.bounds.max;
+    return true;
+}
+
+MeshInstance::MeshInstance(std::shared_ptr<const MeshData> data,
+                           mat_pointer material, Vec3 origin, Vec3 scale,
+                           Vec3 rotation)
+    : data(std::move(data)) {
+    this->material = material;
+    frame.origin = origin;
+    frame.scale = scale;
+    frame.rotation = rotation;
+    frame.lockFrame();
+}
+
+bool MeshInstance::_intersect(const Ray &ray, IntersectionOut &intsec_out) {
+    intsec_out.t = TINGE_INFINITY;
+    return data->bvh.intersect(ray, intsec_out);
+}
+
+// The packet is moved into object space lane by lane, hits are moved back
+// the same way AbstractShape::intersect does for single rays
+void MeshInstance::intersect_packet(const RayPacket &packet, int lanes,
+                                    IntersectionOut out[4]) {
+    RayPacket frame_packet;
+    for (int i = 0; i < 4; i++)
+        if (lanes & (1 << i))
+            frame_packet.rays[i] =
+                Ray(frame.worldToFrame * packet.rays[i].origin,
+                    (frame.worldToFrame & packet.rays[i].direction).normalized());
+    frame_packet.pack(lanes);
+
+    Float4 t_hit;
+    uint32_t hit_triangle[4];
+    int hits =
+        data->bvh.intersect_packet(frame_packet, lanes, t_hit, hit_triangle);
+    Mat4 normal_to_world = transpose(frame.worldToFrame);
+
+    for (int i = 0; i < 4; i++) {
+        if (!(lanes & (1 << i)))
+            continue;
+        out[i] = IntersectionOut();
+        if (!(hits & (1 << i)))
+            continue;
+        const Ray &ray = packet.rays[i];
+        out[i].hit = true;
+        out[i].point = frame.frameToWorld * frame_packet.rays[i].at(t_hit[i]);
+        out[i].t = (out[i].point - ray.origin).length();
+        out[i].normal =
+            (normal_to_world & data->bvh.normal(hit_triangle[i])).normalized();
+        out[i].hit_mat = material.get();
+        out[i].w0 = ray;
+    }
+}
+
+void MeshInstance::get_emitters(std::vector<Emitter> &emitters) {
+    if (!material->is_emissive())
+        return;
+    const BVH &bvh = data->bvh;
+    for (uint32_t i = 0; i < bvh.triangle_count(); i++)
+        emitters.push_back(Emitter::triangle(
+            frame.frameToWorld * bvh.vertex(i, 0),
+            frame.frameToWorld * bvh.vertex(i, 1),
+            frame.frameToWorld * bvh.vertex(i, 2), material.get(), this));
+}
+
+Vec3 MeshInstance::_get_normal(const Vec3 &point) { return Vec3(0, 0, 0); }
+
+bool MeshInstance::_get_bounds(Vec3 &min, Vec3 &max) {
+    min = data->bvh.bounds.min;
+    max = data->bvh.bounds.max;
+    return true;
+}
@@ -4,11 +4,52 @@
 #include "objects.h"
 #include <memory>
 
+/***********************************
+ * Triangles and BVH built from a mesh file
+ * Held through shared pointers so any number of shapes can draw the same
+ * data.
+ ***********************************/
+struct MeshData {
+    BVH bvh; /**< Flattened BVH of the mesh's triangles */
+
+    /******************************************
+     * @brief Loads a mesh file and builds its BVH
+     * @param fname Path to .obj file
+     * @param frame Frame the vertices are moved into, they stay as they are
+     * in the file for an identity frame
+     * @param bvh_height Height of bvh (only used by BVH_Split::MIDPOINT)
+     * @param bvh_split Strategy used to build the bvh
+     ******************************************/
+    MeshData(const std::string &fname, const Frame &frame, int bvh_height,
+             BVH_Split bvh_split);
+
+    /******************************************
+     * @brief Object space data of a mesh file
+     * Loaded once per path and BVH settings, later calls return the same
+     * data for as long as any shape still holds it. Different meshes load
+     * on their callers' threads at the same time, callers asking for a mesh
+     * still loading wait for it.
+     ******************************************/
+    static std::shared_ptr<const MeshData>
+    get(const std::string &fname, int bvh_height = 5,
+        BVH_Split bvh_split = BVH_Split::MIDPOINT);
+
+    /******************************************
+     * @brief Mesh data moved into a frame, shared like get above
+     * @param frame Locked frame the vertices are moved into
+     ******************************************/
+    static std::shared_ptr<const MeshData>
+    get(const std::string &fname, const Frame &frame, int bvh_height,
+        BVH_Split bvh_split);
+};
+
 /***********************************
  * Mesh Class
+ * Triangles are stored in world space, meshes with the same file, frame
+ * and BVH settings share them through MeshData::get.
  ***********************************/
 struct Mesh : AbstractShape {
-    std::unique_ptr<BVH_Node> root; /**< Root node for mesh's BVH */
+    std::shared_ptr<const MeshData> data; /**< World space triangles*/
 
     /******************************************
      * @brief Parametrized mesh constructor
@@ -17,13 +58,49 @@ struct Mesh : AbstractShape {
      * @param origin Origin of frame
      * @param scale Scale of frame
      * @param rotation Rotation of frame
-     * @param bvh_height Height of bvh
+     * @param bvh_height Height of bvh (only used by BVH_Split::MIDPOINT)
+     * @param bvh_split Strategy used to build the bvh
      * @note The frame of a mesh cannot be modified after construction
      ******************************************/
     Mesh(const std::string &fname, mat_pointer material, Vec3 origin,
-         Vec3 scale, Vec3 rotation, int bvh_height = 5);
+         Vec3 scale, Vec3 rotation, int bvh_height = 5,
+         BVH_Split bvh_split = BVH_Split::MIDPOINT);
+
+    void intersect_packet(const RayPacket &packet, int lanes,
+                          IntersectionOut out[4]) override;
+    void get_emitters(std::vector<Emitter> &emitters) override;
+
+  protected:
+    bool _intersect(const Ray &ray, IntersectionOut &intsec_out) override;
+    Vec3 _get_normal(const Vec3 &point) override;
+    bool _get_bounds(Vec3 &min, Vec3 &max) override;
+};
+
+/***********************************
+ * Placement of shared mesh data
+ * Only the frame and a pointer are stored per instance, rays are moved
+ * into the object space of the data instead.
+ ***********************************/
+struct MeshInstance : AbstractShape {
+    std::shared_ptr<const MeshData> data; /**< Object space triangles*/
+
+    /******************************************
+     * @brief Places mesh data in the scene
+     * @param data Mesh data, usually from MeshData::get
+     * @param material Material of the instance
+     * @param origin Origin of frame
+     * @param scale Scale of frame
+     * @param rotation Rotation of frame
+     ******************************************/
+    MeshInstance(std::shared_ptr<const MeshData> data, mat_pointer material,
+                 Vec3 origin, Vec3 scale, Vec3 rotation);
+
+    void intersect_packet(const RayPacket &packet, int lanes,
+                          IntersectionOut out[4]) override;
+    void get_emitters(std::vector<Emitter> &emitters) override;
 
   protected:
     bool _intersect(const Ray &ray, IntersectionOut &intsec_out) override;
     Vec3 _get_normal(const Vec3 &point) override;
+    bool _get_bounds(Vec3 &min, Vec3 &max) override;
 };
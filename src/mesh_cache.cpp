@@ -0,0 +1,208 @@
+#include "mesh_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+
+/*************************************
+ * Cache file signature and layout version, bump the version whenever the
+ * BVH build or the layout of the cached arrays changes
+ *************************************/
+static const char MESH_CACHE_MAGIC[8] = {'T', 'I', 'N', 'G', 'E', 'M', 'S', 'H'};
+constexpr uint32_t MESH_CACHE_VERSION = 4;
+
+// Arrays are written to cache files as raw memory
+static_assert(sizeof(Vec3) == 3 * sizeof(float), "Vec3 must be packed");
+static_assert(std::is_trivially_copyable<BVH_WideNode>::value &&
+                  std::is_trivially_copyable<TriangleBlock>::value,
+              "BVH arrays must be trivially copyable");
+
+/*************************************
+ * Header of a cache file, followed by the vertices, triangle vertex
+ * indices, nodes, leaf indices and blocks
+ *************************************/
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size, block_size; /**< Guard against layout changes*/
+    uint64_t key;
+    uint64_t source; /**< Hash of the mesh file alone*/
+    uint64_t num_vertices, num_triangle_indices, num_nodes, num_indices,
+        num_blocks;
+    float bounds_min[3], bounds_max[3];
+};
+
+std::string mesh_cache_path(const std::string &mesh_path, uint64_t key) {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+    return mesh_path + "." + hex + ".bvhcache";
+}
+
+/*************************************
+ * @brief Checks that count elements of T fit in a file of the given size,
+ * before count is multiplied by anything
+ *************************************/
+template <typename T> static bool fits(uint64_t count, uint64_t size) {
+    return count <= size / sizeof(T);
+}
+
+/*************************************
+ * @brief Reads the next count elements of a cache file straight into out
+ *************************************/
+template <typename T>
+static bool read_array(std::ifstream &in, uint64_t count, std::vector<T> &out) {
+    out.resize(count);
+    in.read(reinterpret_cast<char *>(out.data()), count * sizeof(T));
+    return bool(in);
+}
+
+template <typename T>
+static void write_array(std::ofstream &out, const std::vector<T> &data) {
+    out.write(reinterpret_cast<const char *>(data.data()),
+              data.size() * sizeof(T));
+}
+
+bool load_mesh_cache(const std::string &path, uint64_t key, BVH &bvh) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+    uint64_t size = uint64_t(in.tellg());
+    in.seekg(0);
+    if (size < sizeof(MeshCacheHeader))
+        return false;
+
+    MeshCacheHeader header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in ||
+        std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) ||
+        header.version != MESH_CACHE_VERSION ||
+        header.node_size != sizeof(BVH_WideNode) ||
+        header.block_size != sizeof(TriangleBlock) || header.key != key)
+        return false;
+
+    // Counts come from the file, each is bounded by the file size first so
+    // the sum below cannot wrap around
+    bool valid =
+        fits<Vec3>(header.num_vertices, size) &&
+        fits<uint32_t>(header.num_triangle_indices, size) &&
+        fits<BVH_WideNode>(header.num_nodes, size) &&
+        fits<uint32_t>(header.num_indices, size) &&
+        fits<TriangleBlock>(header.num_blocks, size);
+    valid = valid &&
+            size == sizeof(header) + header.num_vertices * sizeof(Vec3) +
+                        (header.num_triangle_indices + header.num_indices) *
+                            sizeof(uint32_t) +
+                        header.num_nodes * sizeof(BVH_WideNode) +
+                        header.num_blocks * sizeof(TriangleBlock) &&
+            header.num_triangle_indices % 3 == 0 &&
+            header.num_blocks * TRIANGLE_BLOCK_SIZE == header.num_indices;
+    valid = valid && read_array(in, header.num_vertices, bvh.vertices) &&
+            read_array(in, header.num_triangle_indices, bvh.triangles) &&
+            read_array(in, header.num_nodes, bvh.nodes) &&
+            read_array(in, header.num_indices, bvh.indices) &&
+            read_array(in, header.num_blocks, bvh.blocks);
+
+    // Indices out of range would crash traversal, treat them as damage
+    uint64_t num_triangles = bvh.triangle_count();
+    for (uint32_t v : bvh.triangles)
+        valid &= v < bvh.vertices.size();
+    for (uint32_t i : bvh.indices)
+        valid &= i < num_triangles;
+    for (const BVH_WideNode &node : bvh.nodes)
+        for (int c = 0; c < BVH_WIDTH; c++)
+            valid &= node.count[c]
+                         ? uint64_t(node.offset[c]) + node.count[c] <=
+                               bvh.indices.size()
+                         : node.offset[c] < bvh.nodes.size();
+    if (!valid) {
+        std::cerr << "[Mesh Cache] " << path << " is damaged, rebuilding\n";
+        bvh.vertices.clear();
+        bvh.triangles.clear();
+        bvh.nodes.clear();
+        bvh.indices.clear();
+        bvh.blocks.clear();
+        return false;
+    }
+
+    // Set directly, an empty mesh keeps its inverted box
+    bvh.bounds = BVH_Volume();
+    bvh.bounds.min = Vec3(header.bounds_min[0], header.bounds_min[1],
+                          header.bounds_min[2]);
+    bvh.bounds.max = Vec3(header.bounds_max[0], header.bounds_max[1],
+                          header.bounds_max[2]);
+    return true;
+}
+
+bool save_mesh_cache(const std::string &path, uint64_t key, uint64_t source,
+                     const BVH &bvh) {
+    MeshCacheHeader header = {};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.node_size = sizeof(BVH_WideNode);
+    header.block_size = sizeof(TriangleBlock);
+    header.key = key;
+    header.source = source;
+    header.num_vertices = bvh.vertices.size();
+    header.num_triangle_indices = bvh.triangles.size();
+    header.num_nodes = bvh.nodes.size();
+    header.num_indices = bvh.indices.size();
+    header.num_blocks = bvh.blocks.size();
+    const Vec3 &lo = bvh.bounds.min, &hi = bvh.bounds.max;
+    header.bounds_min[0] = lo.x, header.bounds_min[1] = lo.y;
+    header.bounds_min[2] = lo.z;
+    header.bounds_max[0] = hi.x, header.bounds_max[1] = hi.y;
+    header.bounds_max[2] = hi.z;
+
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_array(out, bvh.vertices);
+        write_array(out, bvh.triangles);
+        write_array(out, bvh.nodes);
+        write_array(out, bvh.indices);
+        write_array(out, bvh.blocks);
+        if (!out) {
+            out.close();
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+void remove_stale_mesh_caches(const std::string &mesh_path, uint64_t source) {
+    namespace fs = std::filesystem;
+    fs::path mesh(mesh_path);
+    fs::path dir = mesh.has_parent_path() ? mesh.parent_path() : fs::path(".");
+    std::string prefix = mesh.filename().string() + ".";
+    const std::string suffix = ".bvhcache";
+
+    std::error_code error;
+    for (const fs::directory_entry &entry : fs::directory_iterator(dir, error)) {
+        // Only <mesh>.<16 hex digits>.bvhcache files belong to this mesh
+        std::string name = entry.path().filename().string();
+        if (name.size() != prefix.size() + 16 + suffix.size() ||
+            name.compare(0, prefix.size(), prefix) ||
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) ||
+            name.find_first_not_of("0123456789abcdef", prefix.size()) !=
+                prefix.size() + 16)
+            continue;
+
+        MeshCacheHeader header;
+        {
+            std::ifstream in(entry.path(), std::ios::binary);
+            in.read(reinterpret_cast<char *>(&header), sizeof(header));
+            if (!in || std::memcmp(header.magic, MESH_CACHE_MAGIC,
+                                   sizeof(header.magic)))
+                continue;
+        }
+        if (header.version == MESH_CACHE_VERSION && header.source == source)
+            continue;
+        if (fs::remove(entry.path(), error))
+            std::cout << "[Mesh Cache] Removed stale cache '"
+                      << entry.path().string() << "'" << std::endl;
+    }
+}
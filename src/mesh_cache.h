@@ -0,0 +1,45 @@
+#pragma once
+
+#include "bvh.h"
+#include "math.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/***************************************************
+ * @brief Path of the cache file kept next to a mesh file
+ * The key is part of the name, so loads of one file with different frames
+ * or BVH settings keep separate caches.
+ * @param key Hash of everything the cached data was built from
+ ***************************************************/
+std::string mesh_cache_path(const std::string &mesh_path, uint64_t key);
+
+/***************************************************
+ * @brief Loads a mesh cache file if it was written for the same key
+ * The header is checked against the key, the layout version and the size
+ * of the file before the arrays are read into the BVH.
+ * @param key Hash of everything the cached data was built from
+ * @param bvh Receives the vertices, triangles, nodes, leaf indices, blocks
+ * and bounds
+ * @return False if the file is missing, stale or damaged
+ ***************************************************/
+bool load_mesh_cache(const std::string &path, uint64_t key, BVH &bvh);
+
+/***************************************************
+ * @brief Writes a mesh cache file
+ * The file is written next to the target and renamed over it, so an
+ * interrupted write never leaves a damaged cache behind.
+ * @param source Hash of the mesh file alone, kept to find stale caches
+ * @return False if the file could not be written
+ ***************************************************/
+bool save_mesh_cache(const std::string &path, uint64_t key, uint64_t source,
+                     const BVH &bvh);
+
+/***************************************************
+ * @brief Deletes the caches of a mesh file that can never be loaded again
+ * Caches built from other contents of the mesh file or with another layout
+ * version are removed. Caches of the same contents with other frames or BVH
+ * settings are kept, other scenes may still load them.
+ * @param source Hash of the current contents of the mesh file
+ ***************************************************/
+void remove_stale_mesh_caches(const std::string &mesh_path, uint64_t source);
@@ -0,0 +1,298 @@
+#include "obj_parser.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+/*************************************
+ * Smallest piece of a file given its own thread, below this the cost of
+ * starting a thread outweighs the parsing
+ *************************************/
+constexpr size_t OBJ_MIN_CHUNK_SIZE = 1 << 20;
+
+/*************************************
+ * Kinds of line that produce data
+ *************************************/
+enum struct ObjLine { Position, UV, Normal, Face, Other };
+
+/*************************************
+ * A line aligned piece of the file and what parsing it produced
+ *************************************/
+struct ObjChunk {
+    const char *begin, *end;
+    size_t num_positions = 0, num_uvs = 0, num_normals = 0;
+    size_t first_position = 0, first_uv = 0, first_normal = 0;
+    std::vector<uint32_t> position_indices, uv_indices, normal_indices;
+    bool valid = true;
+};
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skip_space(const char *p, const char *end) {
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+/***************************************************
+ * @brief Works out the kind of a line from its keyword
+ * @param p Start of the line, left just after the keyword
+ ***************************************************/
+static ObjLine classify_line(const char *&p, const char *end) {
+    p = skip_space(p, end);
+    if (end - p < 2)
+        return ObjLine::Other;
+    if (p[0] == 'f' && is_space(p[1])) {
+        p += 1;
+        return ObjLine::Face;
+    }
+    if (p[0] != 'v')
+        return ObjLine::Other;
+    if (is_space(p[1])) {
+        p += 1;
+        return ObjLine::Position;
+    }
+    if (end - p < 3 || !is_space(p[2]))
+        return ObjLine::Other;
+    p += 2;
+    if (p[-1] == 't')
+        return ObjLine::UV;
+    if (p[-1] == 'n')
+        return ObjLine::Normal;
+    return ObjLine::Other;
+}
+
+/***************************************************
+ * @brief Reads the next number of a vertex line, missing or malformed
+ * numbers read as zero so that every vertex line still adds one vertex
+ ***************************************************/
+static const char *parse_float(const char *p, const char *end, float &value) {
+    p = skip_space(p, end);
+    if (p < end && *p == '+')
+        p++;
+    value = 0.0f;
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec == std::errc::invalid_argument)
+        return p;
+    // Denormal and overflowing values are read as zero
+    if (result.ec == std::errc::result_out_of_range)
+        value = 0.0f;
+    return result.ptr;
+}
+
+static const char *parse_int(const char *p, const char *end, int64_t &value) {
+    if (p < end && *p == '+')
+        p++;
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+        value = 0;
+    return result.ptr;
+}
+
+/***************************************************
+ * @brief Turns a one based or negative relative OBJ index into a zero based
+ * index into count elements
+ * @return False if the index points at nothing
+ ***************************************************/
+static inline bool resolve_index(int64_t index, size_t seen, size_t count,
+                                 uint32_t &out) {
+    int64_t resolved = index > 0 ? index - 1 : int64_t(seen) + index;
+    if (index == 0 || resolved < 0 || uint64_t(resolved) >= count)
+        return false;
+    out = uint32_t(resolved);
+    return true;
+}
+
+/***************************************************
+ * @brief Counts the vertex lines of a chunk
+ ***************************************************/
+static void count_chunk(ObjChunk &chunk) {
+    for (const char *line = chunk.begin; line < chunk.end;) {
+        const char *line_end = static_cast<const char *>(
+            std::memchr(line, '\n', chunk.end - line));
+        if (!line_end)
+            line_end = chunk.end;
+        const char *p = line;
+        switch (classify_line(p, line_end)) {
+        case ObjLine::Position: chunk.num_positions++; break;
+        case ObjLine::UV: chunk.num_uvs++; break;
+        case ObjLine::Normal: chunk.num_normals++; break;
+        default: break;
+        }
+        line = line_end + 1;
+    }
+}
+
+/***************************************************
+ * @brief Parses a chunk, vertices go straight to their place in the mesh
+ * and faces to the index arrays of the chunk
+ * @param totals Number of positions, texture coordinates and normals in
+ * the whole file
+ ***************************************************/
+static void parse_chunk(ObjChunk &chunk, ObjMesh &mesh, const size_t totals[3]) {
+    size_t position = chunk.first_position, uv = chunk.first_uv,
+           normal = chunk.first_normal;
+    // Corners of the current polygon
+    std::vector<uint32_t> corners[3];
+
+    for (const char *line = chunk.begin; line < chunk.end;) {
+        const char *line_end = static_cast<const char *>(
+            std::memchr(line, '\n', chunk.end - line));
+        if (!line_end)
+            line_end = chunk.end;
+        const char *p = line;
+
+        switch (classify_line(p, line_end)) {
+        case ObjLine::Position: {
+            Vec3 &v = mesh.positions[position++];
+            p = parse_float(p, line_end, v.x);
+            p = parse_float(p, line_end, v.y);
+            parse_float(p, line_end, v.z);
+            break;
+        }
+        case ObjLine::UV: {
+            float *v = &mesh.uvs[2 * uv++];
+            p = parse_float(p, line_end, v[0]);
+            parse_float(p, line_end, v[1]);
+            break;
+        }
+        case ObjLine::Normal: {
+            Vec3 &v = mesh.normals[normal++];
+            p = parse_float(p, line_end, v.x);
+            p = parse_float(p, line_end, v.y);
+            parse_float(p, line_end, v.z);
+            break;
+        }
+        case ObjLine::Face: {
+            for (std::vector<uint32_t> &c : corners)
+                c.clear();
+            // Each corner is v, v/vt, v//vn or v/vt/vn
+            while ((p = skip_space(p, line_end)) < line_end) {
+                if (!(*p == '-' || *p == '+' || (*p >= '0' && *p <= '9')))
+                    break;
+                int64_t index[3] = {0, 0, 0};
+                p = parse_int(p, line_end, index[0]);
+                for (int k = 1; k < 3 && p < line_end && *p == '/'; k++) {
+                    p++;
+                    if (p < line_end && *p != '/')
+                        p = parse_int(p, line_end, index[k]);
+                }
+                size_t seen[3] = {position, uv, normal};
+                for (int k = 0; k < 3; k++) {
+                    uint32_t resolved = OBJ_NO_INDEX;
+                    if ((k == 0 || index[k]) &&
+                        !resolve_index(index[k], seen[k], totals[k], resolved))
+                        chunk.valid = false;
+                    corners[k].push_back(resolved);
+                }
+            }
+            // Polygons become triangle fans around the first corner
+            std::vector<uint32_t> *out[3] = {&chunk.position_indices,
+                                             &chunk.uv_indices,
+                                             &chunk.normal_indices};
+            for (size_t i = 1; i + 1 < corners[0].size(); i++)
+                for (int k = 0; k < 3; k++) {
+                    out[k]->push_back(corners[k][0]);
+                    out[k]->push_back(corners[k][i]);
+                    out[k]->push_back(corners[k][i + 1]);
+                }
+            break;
+        }
+        default: break;
+        }
+        line = line_end + 1;
+    }
+}
+
+/***************************************************
+ * @brief Runs fn on every chunk, one thread per chunk
+ ***************************************************/
+template <typename F>
+static void parallel_chunks(std::vector<ObjChunk> &chunks, F fn) {
+    std::vector<std::thread> threads;
+    threads.reserve(chunks.size() - 1);
+    for (size_t i = 0; i + 1 < chunks.size(); i++)
+        threads.emplace_back(fn, std::ref(chunks[i]));
+    fn(chunks.back());
+    for (std::thread &t : threads)
+        t.join();
+}
+
+bool parse_obj(const char *data, size_t size, ObjMesh &mesh,
+               unsigned int num_threads) {
+    mesh = ObjMesh();
+    if (!num_threads)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t num_chunks =
+        std::max<size_t>(1, std::min<size_t>(num_threads, size / OBJ_MIN_CHUNK_SIZE));
+
+    // Chunk boundaries are moved forward to the start of the next line
+    std::vector<ObjChunk> chunks(num_chunks);
+    const char *end = data + size, *begin = data;
+    for (size_t i = 0; i < num_chunks; i++) {
+        const char *chunk_end = data + size * (i + 1) / num_chunks;
+        if (i + 1 < num_chunks) {
+            chunk_end = std::max(chunk_end, begin);
+            const char *newline = static_cast<const char *>(
+                std::memchr(chunk_end, '\n', end - chunk_end));
+            chunk_end = newline ? newline + 1 : end;
+        } else
+            chunk_end = end;
+        chunks[i].begin = begin;
+        chunks[i].end = chunk_end;
+        begin = chunk_end;
+    }
+
+    parallel_chunks(chunks, count_chunk);
+    size_t totals[3] = {0, 0, 0};
+    for (ObjChunk &chunk : chunks) {
+        chunk.first_position = totals[0];
+        chunk.first_uv = totals[1];
+        chunk.first_normal = totals[2];
+        totals[0] += chunk.num_positions;
+        totals[1] += chunk.num_uvs;
+        totals[2] += chunk.num_normals;
+    }
+    if (totals[0] > OBJ_NO_INDEX || totals[1] > OBJ_NO_INDEX ||
+        totals[2] > OBJ_NO_INDEX) {
+        std::cerr << "[OBJ] Too many vertices for 32-bit indices" << std::endl;
+        return false;
+    }
+    mesh.positions.resize(totals[0]);
+    mesh.uvs.resize(2 * totals[1]);
+    mesh.normals.resize(totals[2]);
+
+    parallel_chunks(chunks,
+                    [&](ObjChunk &chunk) { parse_chunk(chunk, mesh, totals); });
+
+    size_t num_indices = 0;
+    bool valid = true;
+    for (const ObjChunk &chunk : chunks) {
+        num_indices += chunk.position_indices.size();
+        valid &= chunk.valid;
+    }
+    if (!valid) {
+        std::cerr << "[OBJ] A face refers to a vertex that does not exist"
+                  << std::endl;
+        mesh = ObjMesh();
+        return false;
+    }
+    mesh.position_indices.reserve(num_indices);
+    mesh.uv_indices.reserve(num_indices);
+    mesh.normal_indices.reserve(num_indices);
+    for (const ObjChunk &chunk : chunks) {
+        mesh.position_indices.insert(mesh.position_indices.end(),
+                                     chunk.position_indices.begin(),
+                                     chunk.position_indices.end());
+        mesh.uv_indices.insert(mesh.uv_indices.end(), chunk.uv_indices.begin(),
+                               chunk.uv_indices.end());
+        mesh.normal_indices.insert(mesh.normal_indices.end(),
+                                   chunk.normal_indices.begin(),
+                                   chunk.normal_indices.end());
+    }
+    return true;
+}
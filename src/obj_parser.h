@@ -0,0 +1,39 @@
+#pragma once
+
+#include "math.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*************************************
+ * Marks a face corner without a texture coordinate or normal
+ *************************************/
+constexpr uint32_t OBJ_NO_INDEX = UINT32_MAX;
+
+/***********************************
+ * Geometry of a Wavefront OBJ file in flat arrays
+ * Polygons are split into triangle fans, each triangle adds three entries
+ * to every index array. Groups, objects and materials are not kept, the
+ * whole file is one mesh.
+ ***********************************/
+struct ObjMesh {
+    std::vector<Vec3> positions;
+    std::vector<Vec3> normals;
+    std::vector<float> uvs; /**< Two floats per texture coordinate*/
+    std::vector<uint32_t> position_indices;
+    std::vector<uint32_t> uv_indices;     /**< OBJ_NO_INDEX where unset*/
+    std::vector<uint32_t> normal_indices; /**< OBJ_NO_INDEX where unset*/
+
+    size_t triangle_count() const { return position_indices.size() / 3; }
+};
+
+/***************************************************
+ * @brief Parses OBJ text already in memory
+ * Large inputs are cut into line aligned chunks parsed on separate threads.
+ * A first pass counts the vertices of each chunk so that every chunk knows
+ * where its vertices land and can resolve relative indices on its own.
+ * @param num_threads Zero for one thread per hardware thread
+ * @return False if a face refers to a vertex that does not exist
+ ***************************************************/
+bool parse_obj(const char *data, size_t size, ObjMesh &mesh,
+               unsigned int num_threads = 0);
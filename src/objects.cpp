@@ -1,4 +1,5 @@
 #include "objects.h"
+#include "emitters.h"
 #include "material.h"
 #include "math.h"
 #include "util.h"
@@ -11,12 +12,10 @@ IntersectionOut::IntersectionOut()
 IntersectionOut AbstractShape::intersect(const Ray &ray) {
     Ray frame_ray = ray;
 
-    if (type == GeneralFrameObject) {
-        frame_ray.origin = this->frame.worldToFrame * frame_ray.origin;
-        frame_ray.direction = this->frame.worldToFrame & frame_ray.direction;
-
-        frame_ray.direction = normalize(frame_ray.direction);
-    }
+    // Rebuilt through the constructor so inv_dir follows the direction
+    if (type == GeneralFrameObject)
+        frame_ray = Ray(this->frame.worldToFrame * ray.origin,
+                        (this->frame.worldToFrame & ray.direction).normalized());
     IntersectionOut intsec_out;
     bool hit = this->_intersect(frame_ray, intsec_out);
     intsec_out.hit = hit;
@@ -37,12 +36,45 @@ IntersectionOut AbstractShape::intersect(const Ray &ray) {
     return intsec_out;
 }
 
+void AbstractShape::intersect_packet(const RayPacket &packet, int lanes,
+                                     IntersectionOut out[4]) {
+    for (int i = 0; i < 4; i++)
+        if (lanes & (1 << i))
+            out[i] = intersect(packet.rays[i]);
+}
+
 Vec3 AbstractShape::get_normal(const Vec3 &point) {
     Vec3 frame_point = this->frame.frameToWorld & point;
     Vec3 frame_normal = this->_get_normal(frame_point);
     return transpose(frame.worldToFrame) & frame_normal;
 }
 
+bool AbstractShape::get_bounds(Vec3 &min, Vec3 &max) {
+    Vec3 frame_min, frame_max;
+    if (!this->_get_bounds(frame_min, frame_max))
+        return false;
+
+    // Empty boxes stay empty, their infinite corners cannot be transformed
+    if (type != GeneralFrameObject || frame_min.x > frame_max.x) {
+        min = frame_min;
+        max = frame_max;
+        return true;
+    }
+
+    // Bound all eight transformed corners of the frame space box
+    min = Vec3(TINGE_INFINITY, TINGE_INFINITY, TINGE_INFINITY);
+    max = -min;
+    for (int i = 0; i < 8; i++) {
+        Vec3 corner((i & 1) ? frame_max.x : frame_min.x,
+                    (i & 2) ? frame_max.y : frame_min.y,
+                    (i & 4) ? frame_max.z : frame_min.z);
+        corner = frame.frameToWorld * corner;
+        min = v_min(min, corner);
+        max = v_max(max, corner);
+    }
+    return true;
+}
+
 Triangle::Triangle(Vec3 v1, Vec3 v2, Vec3 v3, mat_pointer mat)
     : v1(v1), v2(v2), v3(v3) {
     n = cross(v1 - v2, v2 - v3);
@@ -52,44 +84,41 @@ Triangle::Triangle(Vec3 v1, Vec3 v2, Vec3 v3, mat_pointer mat)
     centre = (v1 + v2 + v3) / 3;
     max = v_max(v_max(v1, v2), v3);
     min = v_min(v_min(v1, v2), v3);
+    edges = TriangleEdges{v1, v2 - v1, v3 - v1};
 };
 Triangle::~Triangle() {}
 
 bool Triangle::_intersect(const Ray &ray, IntersectionOut &intersect_out) {
-    float d = dot(ray.direction, this->n);
-
-    if (is_zero(d))
-        return false;
-
-    float a[3]; // Barycentric coordinates
-
-    Vec3 e1 = this->v2 - this->v1;
-    Vec3 e2 = this->v3 - this->v1;
-    Vec3 lhs = ray.origin - this->v1;
-
-    Vec3 c1 = cross(e1, ray.direction);
-    Vec3 c2 = cross(e2, ray.direction);
-
-    a[1] = dot(lhs, c2) / dot(e1, c2);
-    a[2] = dot(lhs, c1) / dot(c1, e2);
-
-    a[0] = 1 - a[1] - a[2];
-
-    if (!(a[0] > 0 && a[1] > 0 && a[2] > 0))
+    float t;
+    if (!intersect_triangle(edges, ray, TINGE_INFINITY, t))
         return false;
-    Vec3 intersection_point =
-        this->v1 * a[0] + this->v2 * a[1] + this->v3 * a[2];
 
-    // Assuming normalized direction
-    float lambda = dot(intersection_point - ray.origin, ray.direction);
     intersect_out.normal = this->n;
-    intersect_out.t = lambda;
-    intersect_out.point = intersection_point;
-    return lambda > 0;
+    intersect_out.t = t;
+    intersect_out.point = ray.at(t);
+    return true;
 }
 
 Vec3 Triangle::_get_normal(const Vec3 &point) { return this->n; }
 
+void Triangle::get_emitters(std::vector<Emitter> &emitters) {
+    if (!material->is_emissive())
+        return;
+    if (type == GeneralFrameObject)
+        emitters.push_back(Emitter::triangle(
+            frame.frameToWorld * v1, frame.frameToWorld * v2,
+            frame.frameToWorld * v3, material.get(), this));
+    else
+        emitters.push_back(
+            Emitter::triangle(v1, v2, v3, material.get(), this));
+}
+
+bool Triangle::_get_bounds(Vec3 &min, Vec3 &max) {
+    min = this->min;
+    max = this->max;
+    return true;
+}
+
 Sphere::Sphere(Vec3 centre, float radius, std::shared_ptr<AbstractMaterial> mat)
     : c(centre), r(radius) {
     material = mat;
@@ -122,6 +151,21 @@ Vec3 Sphere::_get_normal(const Vec3 &point) {
     Vec3 ret = point - this->c;
     return ret / r;
 }
+
+// Frames of spheres are assumed to scale uniformly
+void Sphere::get_emitters(std::vector<Emitter> &emitters) {
+    if (!material->is_emissive())
+        return;
+    emitters.push_back(Emitter::sphere(frame.frameToWorld * c,
+                                       r * frame.scale.x, material.get(),
+                                       this));
+}
+
+bool Sphere::_get_bounds(Vec3 &min, Vec3 &max) {
+    min = c - Vec3(r, r, r);
+    max = c + Vec3(r, r, r);
+    return true;
+}
 Plane::Plane(Vec3 normal, Vec3 point, mat_pointer mat) : n(normal), p(point) {
     material = mat;
 };
@@ -144,20 +188,4 @@ bool Plane::_intersect(const Ray &ray, IntersectionOut &intersect_out) {
 }
 Vec3 Plane::_get_normal(const Vec3 &point) { return this->n; }
 
-std::pair<AbstractShape *, IntersectionOut>
-closestIntersect(const std::vector<obj_pointer> &v, const Ray &ray) {
-    IntersectionOut min_hit;
-    min_hit.t = TINGE_INFINITY;
-    AbstractShape *min_shape = NULL;
-    for (int i = 0; i < v.size(); i++) {
-        IntersectionOut ans = v[i]->intersect(ray);
-        if (ans.hit) {
-            if (ans.t < min_hit.t) {
-                min_hit = ans;
-                min_shape = v[i].get();
-            }
-        }
-    }
-
-    return std::pair<AbstractShape *, IntersectionOut>(min_shape, min_hit);
-}
+bool Plane::_get_bounds(Vec3 &, Vec3 &) { return false; }
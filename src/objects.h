@@ -9,6 +9,8 @@
 
 enum AbstractShapeType { GeneralFrameObject, MeshTriangle, MeshObject };
 
+struct Emitter;
+
 /**************************************************************
  * Encapsulation struct for output of intersection routine
  ***************************************************************/
@@ -35,7 +37,33 @@ struct AbstractShape {
      * @return IntersectionOut class with output data
      ***************************************************/
     IntersectionOut intersect(const Ray &ray);
+
+    /***************************************************
+     * @brief Intersection routine for a packet of rays
+     * Checks each lane on its own unless a shape has a packet path
+     * @param packet Light rays to check in world space
+     * @param lanes Bitmask of the lanes to check
+     * @param out Output for each lane, untouched for unchecked lanes
+     ***************************************************/
+    virtual void intersect_packet(const RayPacket &packet, int lanes,
+                                  IntersectionOut out[4]);
     Vec3 get_normal(const Vec3 &point);
+
+    /***************************************************
+     * @brief Bounding box of the shape in world space
+     * @param min Min corner of the box
+     * @param max Max corner of the box
+     * @return False if the shape is unbounded, a shape with nothing to hit
+     * returns true with min above max
+     ***************************************************/
+    bool get_bounds(Vec3 &min, Vec3 &max);
+
+    /***************************************************
+     * @brief Appends the emitting surfaces of the shape in world space
+     * Shapes without an emissive material add nothing.
+     * @param emitters List to append to
+     ***************************************************/
+    virtual void get_emitters(std::vector<Emitter> & /*emitters*/) {}
     virtual ~AbstractShape() {}
 
   protected:
@@ -48,12 +76,59 @@ struct AbstractShape {
 
     // Point in World space
     virtual Vec3 _get_normal(const Vec3 &point) = 0;
+
+    // Bounds in frame space
+    virtual bool _get_bounds(Vec3 &min, Vec3 &max) = 0;
 };
 
 using obj_pointer = std::unique_ptr<AbstractShape>;
 
+/***********************************
+ * Precomputed triangle data for the intersection kernel (36 bytes)
+ ***********************************/
+struct TriangleEdges {
+    Vec3 v1; /**< First vertex*/
+    Vec3 e1; /**< Edge from v1 to v2*/
+    Vec3 e2; /**< Edge from v1 to v3*/
+};
+
+/***************************************************
+ * @brief Moller-Trumbore ray triangle test on precomputed edges
+ * Uses a single reciprocal and rejects as early as possible.
+ * @param tri Triangle to check
+ * @param ray Ray to check, direction assumed normalized
+ * @param t_max Distance beyond which hits are ignored
+ * @param t Distance to the hit, only written on a hit
+ * @return Did the ray hit the triangle closer than t_max
+ ***************************************************/
+static inline bool intersect_triangle(const TriangleEdges &tri, const Ray &ray,
+                                      float t_max, float &t) {
+    Vec3 p = cross(ray.direction, tri.e2);
+    float det = dot(tri.e1, p);
+    if (is_zero(det))
+        return false;
+    float inv_det = 1 / det;
+
+    Vec3 s = ray.origin - tri.v1;
+    float u = dot(s, p) * inv_det;
+    if (!(u > 0 && u < 1))
+        return false;
+
+    Vec3 q = cross(s, tri.e1);
+    float v = dot(ray.direction, q) * inv_det;
+    if (!(v > 0 && u + v < 1))
+        return false;
+
+    float hit_t = dot(tri.e2, q) * inv_det;
+    if (!(hit_t > 0 && hit_t < t_max))
+        return false;
+    t = hit_t;
+    return true;
+}
+
 struct Triangle : AbstractShape {
     Vec3 v1, v2, v3; /**< Position vectors of triangle vertices*/
+    TriangleEdges edges; /**< Intersection kernel data*/
     Vec3 n;          /**< Normal vector of triangle*/
     float h;         /**< Bound box checking heuristic*/
     Vec3 centre;     /**< Centroid*/
@@ -70,9 +145,12 @@ struct Triangle : AbstractShape {
     Triangle(Vec3 v1, Vec3 v2, Vec3 v3, mat_pointer mat);
     ~Triangle();
 
+    void get_emitters(std::vector<Emitter> &emitters) override;
+
   protected:
     bool _intersect(const Ray &ray, IntersectionOut &intsec_out) override;
     Vec3 _get_normal(const Vec3 &point) override;
+    bool _get_bounds(Vec3 &min, Vec3 &max) override;
 };
 
 struct Sphere : AbstractShape {
@@ -89,9 +167,12 @@ struct Sphere : AbstractShape {
            mat_pointer mat); // Parametrized Sphere constructor
     ~Sphere();
 
+    void get_emitters(std::vector<Emitter> &emitters) override;
+
   protected:
     bool _intersect(const Ray &ray, IntersectionOut &intsec_out) override;
     Vec3 _get_normal(const Vec3 &point) override;
+    bool _get_bounds(Vec3 &min, Vec3 &max) override;
 };
 
 struct Plane : AbstractShape {
@@ -111,12 +192,5 @@ struct Plane : AbstractShape {
   protected:
     bool _intersect(const Ray &ray, IntersectionOut &intsec_out) override;
     Vec3 _get_normal(const Vec3 &point) override;
+    bool _get_bounds(Vec3 &min, Vec3 &max) override;
 };
-
-/******************************************************
- * @brief Find closest shape that intersects the ray
- * @param v Vector of the objects to check
- * @param ray Ray to check with
- ******************************************************/
-std::pair<AbstractShape *, IntersectionOut>
-closestIntersect(const std::vector<obj_pointer> &v, const Ray &ray);
@@ -1,86 +1,41 @@
 #include "random.h"
 #include "math.h"
-#include <cmath>
-/************************
- * Constructor for generating Random number 
- ************************/
-Random::Random(unsigned int seed) : seed(seed), generator(seed) {}
-
-/**********************
- * Generates a random number from 0 to 1
- * @return number from (0,1)
- * ********************/
-double Random::GenerateUniformFloat() {
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
-    return distribution(this->generator);
-}
-
-/****************************
- * Generates a random point on a disc of radius 1
- * Sqrt is used to make more uniform distribution on the disc otherwise the randomly generated numbers will be more concentrated to center 
- * @return random point from a disc of radius 1 
- * ****************************/
-Vec3 Random::GenerateUniformPointDisc() {
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
-    double r = std::sqrt(distribution(generator));
-    double theta = distribution(generator) * 2 * M_PI;
-
-    double x = r * std::cos(theta);
-    double y = r * std::sin(theta);
-    return Vec3(x, y, 0);
-}
+#include <cstring>
 
-/*********************
- * Generates a random point on a sphere of radius 1
- * @return point on sphere of radius 1
- *******************/
-Vec3 Random::GenerateUniformPointSphere() {
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
-    float u = distribution(generator);
-    float v = distribution(generator);
+/*************************************
+ * LCG multiplier of PCG32
+ *************************************/
+constexpr uint64_t PCG_MULTIPLIER = 6364136223846793005ull;
 
-    float theta = u * 2 * M_PI;                         // Using Spherical polar coordinates 
-    float cos_phi = 2 * v - 1;
-    float sin_phi = std::sqrt(1 - cos_phi * cos_phi);
-
-    Vec3 ret;
-
-    ret.x = cos_phi;
-    ret.y = std::sin(theta) * sin_phi;
-    ret.z = std::cos(theta) * sin_phi;
-    return ret;
+/************************
+ * Constructor for generating Random number
+ * Seeds as the PCG reference does, so the first output already depends on
+ * the seed
+ ************************/
+Random::Random(uint64_t seed, uint64_t stream)
+    : state(0), inc(stream << 1 | 1) {
+    next();
+    state += seed;
+    next();
 }
 
-/*****************************
- *  Generates a random point on a hemisphere around a normal vector
- * @par n ,A 3D vector representing a normal passing through hemisphere 
- * @return random point on the hemisphere 
- *  */
-Vec3 Random::GenerateUniformPointHemisphere(const Vec3 &n) {
-    Vec3 ret = GenerateUniformPointSphere();
-    float factor = dot(ret, n) > 0 ? 1 : -1;
-
-    return ret * factor;
+uint32_t Random::next() {
+    uint64_t old = state;
+    state = old * PCG_MULTIPLIER + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
 }
 
-// Generate a random point on a hemisphere around a normal vector
-Vec3 Random::GenerateCosinePointHemisphere(const Vec3 &n) {
-    Vec3 ret = GenerateUniformPointDisc();
-    ret.z = std::sqrt(1 - dot(ret, ret));
-
-    float c1 = 1 / (1 + n.z);
-    float c2 = n.y * c1;
-    float c3 = n.x * c1;
-    Mat3 m{};
-    m[0][0] = 1 - n.x * c3;
-    m[0][1] = -n.x * c2;
-    m[0][2] = n.x;
-    m[1][0] = -n.x * c2;
-    m[1][1] = 1 - n.y * c2;
-    m[1][2] = n.y;
-    m[2][0] = -n.x;
-    m[2][1] = -n.y;
-    m[2][2] = n.z;
-
-    return m * ret;
+/**********************
+ * Generates a random number from 0 to 1
+ * The top 23 bits fill the mantissa of a float in [1, 2) and one is
+ * subtracted, so no division or int to float conversion is needed
+ * @return number from [0,1)
+ * ********************/
+float Random::GenerateUniformFloat() {
+    uint32_t bits = 0x3F800000u | (next() >> 9);
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f - 1.0f;
 }
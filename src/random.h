@@ -1,53 +1,50 @@
 #pragma once
 #include "math.h"
-#include <random>
+#include <cstdint>
+
+/*************************************
+ * SplitMix64 finalizer, spreads nearby integers over all 64 bits
+ *************************************/
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
 
 /**************************************
- * Interface for tinge random functions
+ * Pseudo random numbers for samplers that need independent values
+ * Numbers come from a PCG32 generator (O'Neill, XSH-RR output). Its 16
+ * bytes of state are cheap to copy along with a path, and samplers derive
+ * independent streams by hashing the seed with a pixel and sample index, so
+ * every sample sees the same numbers whatever thread or pass renders it.
  **************************************/
 class Random {
   private:
-    unsigned int seed;      /**< Seed of generator*/
-    std::mt19937 generator; /**< Mersenne Twister for random numbers*/
+    uint64_t state; /**< Position in the sequence*/
+    uint64_t inc;   /**< Odd increment selecting the stream*/
+
+    /**************************************
+     * @brief Advances the state and permutes the old one into the output
+     ***************************************/
+    uint32_t next();
 
   public:
     /**************************************
      * @brief Constructor
      * @param seed seed for the PRNG
+     * @param stream Stream of the generator, different streams with the
+     * same seed give unrelated sequences
      ***************************************/
-    Random(unsigned int seed);
+    Random(uint64_t seed = 0, uint64_t stream = 0);
+
+    /**************************************************************
+     * Generates a uniform 32-bit integer
+     ***************************************************************/
+    uint32_t GenerateUniformInt() { return next(); }
 
     /**************************************************************
      * Generates a uniform float in [0, 1)
      * @return A random float in [0, 1) with uniform distribution
      ***************************************************************/
-    double GenerateUniformFloat();
-
-    /*****************************************
-     * Generates a random point in a unit disc
-     * @return A random point in the unit disc as (x, y, 0)
-     *****************************************/
-    Vec3 GenerateUniformPointDisc();
-
-    /*******************************************
-     * Generate a random point on a unit sphere
-     * @return A random point on the unit sphere
-     *******************************************/
-    Vec3 GenerateUniformPointSphere();
-
-    /**********************************************************************
-     * Generate a random point on a unit hemisphere with specified 'central
-     * normal' using a uniform distribution
-     * @param n The central normal of the hemisphere
-     * @return A random point on the specified unit hemisphere
-     **********************************************************************/
-    Vec3 GenerateUniformPointHemisphere(const Vec3 &n);
-
-    /**********************************************************************
-     * Generate a random point on a unit hemisphere with specified 'central
-     * normal' using a cosine weighted distribution
-     * @param n The central normal of the hemisphere
-     * @return A random point on the specified unit hemisphere
-     **********************************************************************/
-    Vec3 GenerateCosinePointHemisphere(const Vec3 &n);
+    float GenerateUniformFloat();
 };
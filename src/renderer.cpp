@@ -1,11 +1,16 @@
 #include "renderer.h"
 #include "camera.h"
+#include "denoiser.h"
+#include "film.h"
+#include "image.h"
+#include "mapped_file.h"
 #include "material.h"
 #include "math.h"
 #include "util.h"
+#include <chrono>
 #include <ctime>
+#include <iomanip>
 #include <iostream>
-#include <mutex>
 #include <ostream>
 #include <algorithm>
 #include <thread>
@@ -29,35 +34,44 @@ Vec3 Renderer::sky_bottom_color = Vec3(1, 1, 1);
 int env_width, env_height, env_channels;
 float *env_data = nullptr;
 
+/*********************************************************************************
+ *  env_distribution : texel lookups and importance sampling of env_data
+ **********************************************************************************/
+EnvironmentMap env_distribution;
+
+unsigned int Renderer::num_threads = 0;
+bool Renderer::wavefront = false;
+float Renderer::adaptive_threshold = 0;
+int Renderer::adaptive_min_samples = 0;
+int Renderer::adaptive_max_samples = 0;
+int Renderer::progressive_samples = 0;
+int Renderer::preview_passes = 0;
+float Renderer::preview_seconds = 0;
+std::string Renderer::checkpoint_file;
+ToneMap Renderer::tone_map = ToneMap::Gamma;
+uint64_t Renderer::seed = 0;
+SamplerType Renderer::sampler_type = SamplerType::Sobol;
+
 /*************************************
- * Used to show rendering progress
+ * Side of the square tiles handed out to render threads
  *************************************/
-std::mutex counter_mutex;
-int counter = 0;
-
-/**************************************
- * Mapping to environment
- * @par direction of the shooted ray
- * @return RGB value of the environment
- ****************************************/
-Vec3 sample_env_map(const Vec3 &dir) {
-    float theta = acos(clamp(dir.y, -1.0f, 1.0f)); // polar angle
-    float phi = atan2(dir.z, dir.x);               // azimuth
-
-    if (phi < 0)
-        phi += 2 * M_PI; // makes phi>=0 and < 2pi
+constexpr int TILE_SIZE = 16;
 
-    float u = phi / (2 * M_PI);
-    float v = theta / M_PI;
-
-    int x = clamp(int(u * env_width), 0,
-                  env_width - 1); // corresponding U,V coordinates
-    int y = clamp(int((1 - v) * env_height), 0, env_height - 1);
+/*************************************
+ * Interval between two progress reports
+ *************************************/
+constexpr std::chrono::milliseconds PROGRESS_INTERVAL(500);
 
-    int index = (y * env_width + x) * env_channels; // index in env_data
+/*************************************
+ * Paths traced together by one wavefront pass of a render thread
+ *************************************/
+constexpr int WAVEFRONT_BATCH = 4096;
 
-    return Vec3(env_data[index], env_data[index + 1], env_data[index + 2]);
-}
+/*************************************
+ * Fraction of the distance to a light sample that shadow rays stop short
+ * of, so they do not report the emitter itself as a blocker
+ *************************************/
+constexpr float SHADOW_EPSILON = 1e-3f;
 
 /******************************************************************
  * @brief Uniform gradient from sky blue to sky white
@@ -69,177 +83,643 @@ Vec3 Renderer::env_light_gradient(const Vec3 &dir) {
     return mix(sky_bottom_color, sky_top_color, t);
 }
 
+/******************************************************************
+ * @brief Light arriving from the environment along a direction
+ * @par Direction of ray
+ * @return Environment map value if one is loaded, else the sky gradient
+ ******************************************************************/
+Vec3 Renderer::environment(const Vec3 &dir) {
+    if (env_data)
+        return env_distribution.lookup(dir);
+    return env_light_gradient(dir);
+}
+
+/******************************************************************
+ * @brief Solid angle pdf of importance sampling the environment map
+ * @par Direction of ray
+ * @return 0 if no environment map is loaded
+ ******************************************************************/
+float Renderer::env_pdf(const Vec3 &dir) {
+    return env_distribution.pdf(dir);
+}
+
+/******************************************************************
+ * @brief Lanes of a 2x2 quad whose pixels have converged
+ * A pixel whose few samples all missed the light looks converged on its
+ * own, so its variance is never taken below the average of its quad.
+ ******************************************************************/
+static int converged_lanes(PixelStats *const stats[4], int lanes,
+                           int min_samples, float threshold) {
+    if (threshold <= 0)
+        return 0;
+
+    float quad_variance = 0;
+    int quad_pixels = 0;
+    for (int k = 0; k < 4; k++) {
+        if (lanes & (1 << k)) {
+            quad_variance += stats[k]->variance();
+            quad_pixels++;
+        }
+    }
+    quad_variance /= quad_pixels;
+
+    int converged = 0;
+    for (int k = 0; k < 4; k++)
+        if ((lanes & (1 << k)) && stats[k]->n >= min_samples &&
+            stats[k]->relative_error(quad_variance) < threshold)
+            converged |= 1 << k;
+    return converged;
+}
+
+/******************************************************************
+ * @brief Hash of what the samples of a render depend on, so a checkpoint is
+ * only resumed by a render of the same scene
+ * Covers the camera, the world bounds and material color of every shape,
+ * the environment and the seed and sampler. The sample count is left out
+ * so a later run may add samples.
+ ******************************************************************/
+static uint64_t render_settings_hash(const Camera &camera,
+                                     const std::vector<obj_pointer> &shapes,
+                                     uint64_t seed, SamplerType sampler_type,
+                                     const Vec3 &sky_top,
+                                     const Vec3 &sky_bottom) {
+    const Frame &frame = camera.frame;
+    float lens[12] = {camera.vertical_fov, camera.focal_length,
+                      camera.aperture_size, frame.origin.x,
+                      frame.origin.y,      frame.origin.z,
+                      frame.rotation.x,    frame.rotation.y,
+                      frame.rotation.z,    frame.scale.x,
+                      frame.scale.y,       frame.scale.z};
+    uint64_t hash = hash_bytes(lens, sizeof(lens));
+
+    for (const obj_pointer &shape : shapes) {
+        Vec3 min, max;
+        bool bounded = shape->get_bounds(min, max);
+        if (!bounded)
+            min = max = Vec3(0, 0, 0);
+        Vec3 color = shape->material ? shape->material->color : Vec3(0, 0, 0);
+        float desc[10] = {float(bounded), min.x, min.y,   min.z,   max.x,
+                          max.y,          max.z, color.x, color.y, color.z};
+        hash = hash_bytes(desc, sizeof(desc), hash);
+    }
+
+    int64_t settings[4] = {int64_t(seed), int64_t(sampler_type),
+                           env_data ? env_width : -1,
+                           env_data ? env_height : -1};
+    float sky[6] = {sky_top.x,    sky_top.y,    sky_top.z,
+                    sky_bottom.x, sky_bottom.y, sky_bottom.z};
+    hash = hash_bytes(settings, sizeof(settings), hash);
+    return hash_bytes(sky, sizeof(sky), hash);
+}
+
 /****************************************************************************************
- * @brief Takes a chunk of the image
- * @return Gives the pixel value at each point in that width of image.
+ * @brief Renders tiles of the image until none are left
+ * Adds samples first_sample to last_sample of every pixel to the film,
+ * pixels that converged in earlier passes or samples are skipped.
  * @return If the point is outside the object, mixes
  * white and skyblue based on the height , but if HDR file is accessible then
  *maps to that
  *****************************************************************************************/
-void Renderer::render_thread(Camera camera, const std::vector<obj_pointer> &shapes,
-                   unsigned char *data, int w1, int w2, int out_width,
-                   int out_height, int num_samples, int depth) {
-    Random random_generator = Random(time(nullptr));
+void Renderer::render_thread(Camera camera, const SceneBVH &scene,
+                   const EmitterList &emitters, const Sampler &sampler,
+                   Film &film, std::atomic<int> &next_tile,
+                   ThreadProgress &progress, int first_sample, int last_sample,
+                   int depth) {
+    int out_width = film.width, out_height = film.height;
     float u, v;
     Vec3 sky_blue = Vec3(0.1f, 0.5f, 0.9f);
     Vec3 sky_white = Vec3(1, 1, 1);
 
-    for (int i = w1; i < w2; i++) {
-        counter_mutex.lock();
-        if ((w2 - i) % (out_width / 100) == 0) {
-            counter++;
+    // Pixels never count as converged unless adaptive sampling is on
+    int min_samples = std::max(2, adaptive_min_samples);
+
+    int tiles_x = (out_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (out_height + TILE_SIZE - 1) / TILE_SIZE;
+    int num_tiles = tiles_x * tiles_y;
+
+    // Pull tiles off the shared counter so no thread idles while work remains
+    for (int tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+        int x0 = (tile % tiles_x) * TILE_SIZE;
+        int y0 = (tile / tiles_x) * TILE_SIZE;
+        int x1 = std::min(x0 + TILE_SIZE, out_width);
+        int y1 = std::min(y0 + TILE_SIZE, out_height);
+
+        // Primary rays of 2x2 pixel quads are traced together as a packet
+        for (int j = y0; j < y1; j += 2) {
+            for (int i = x0; i < x1; i += 2) {
+
+                int lanes = 0, num_lanes = 0;
+                int pixel[4];
+                PixelStats *stats[4];
+                for (int k = 0; k < 4; k++) {
+                    pixel[k] = out_width * (j + (k >> 1)) + i + (k & 1);
+                    if (i + (k & 1) < x1 && j + (k >> 1) < y1) {
+                        lanes |= 1 << k;
+                        num_lanes++;
+                        stats[k] = &film.stats[pixel[k]];
+                    }
+                }
+
+                uint64_t rays = 0;
+                int pixel_samples = 0;
+
+                // Converged pixels drop out of the packet, the quad is done
+                // once every lane has
+                int active = lanes & ~converged_lanes(stats, lanes, min_samples,
+                                                      adaptive_threshold);
+                for (int sample = first_sample; active && sample < last_sample;
+                     sample++) {
+                    // Each sample of a pixel is drawn on its own, so the image
+                    // does not depend on which thread or pass renders it
+                    RayPacket packet;
+                    Sampler lane_sampler[4];
+                    for (int k = 0; k < 4; k++) {
+                        if (!(active & (1 << k)))
+                            continue;
+                        lane_sampler[k] = sampler;
+                        lane_sampler[k].start_sample(i + (k & 1), j + (k >> 1),
+                                                     sample);
+                        float jitter_u, jitter_v;
+                        lane_sampler[k].get_2d(jitter_v, jitter_u);
+                        v = 1 - (float)(j + (k >> 1) + 2 * jitter_v - 1) /
+                                    out_height;
+                        u = (float)(i + (k & 1) + 2 * jitter_u - 1) / out_width;
+                        packet.rays[k] =
+                            camera.generate_ray(u, v, lane_sampler[k]);
+                        pixel_samples++;
+                    }
+                    packet.pack(active);
+
+                    std::pair<AbstractShape *, IntersectionOut> hits[4];
+                    closestIntersect(scene, packet, hits);
+
+                    for (int k = 0; k < 4; k++) {
+                        if (!(active & (1 << k)))
+                            continue;
+                        const Ray &ray = packet.rays[k];
+                        IntersectionOut &details = hits[k].second;
+                        rays++;
+
+                        int pix = pixel[k];
+                        Vec3 L;
+                        if (details.hit == true) {
+                            // First hit features guide the denoiser
+                            film.albedo[pix] = film.albedo[pix] + details.hit_mat->color;
+                            film.normal[pix] = film.normal[pix] + details.normal;
+                            film.depth[pix] += details.t;
+
+                            L = Renderer::illuminance(details, 1, depth, scene,
+                                                      emitters, lane_sampler[k],
+                                                      rays);
+                        } else {
+                            L = environment(ray.direction);
+                            film.albedo[pix] = film.albedo[pix] + Vec3(1, 1, 1);
+                        }
+                        film.radiance[pix] = film.radiance[pix] + L;
+                        stats[k]->add(luminance(L));
+                    }
 
-            if (counter % 10 == 0) {
-                std::cout << "==";
-                std::flush(std::cout);
+                    active &= ~converged_lanes(stats, lanes, min_samples,
+                                               adaptive_threshold);
+                }
+
+                // Only this thread writes its counters, relaxed order is enough.
+                // Samples of the pass that converged pixels skip count as
+                // done, so adaptive renders still finish at the full total
+                uint64_t pass_samples =
+                    uint64_t(num_lanes) * (last_sample - first_sample);
+                progress.samples.fetch_add(pixel_samples, std::memory_order_relaxed);
+                progress.skipped.fetch_add(pass_samples - pixel_samples,
+                                           std::memory_order_relaxed);
+                progress.rays.fetch_add(rays, std::memory_order_relaxed);
             }
         }
-        counter_mutex.unlock();
-
-        for (int j = 0; j < out_height; j++) {
+    }
+}
 
-            int pix = out_width * j + i;
 
-            Vec3 color(0, 0, 0);
+/*************************************
+ * Paths in flight, one entry per path in structure of arrays layout
+ *************************************/
+struct PathQueue {
+    std::vector<Ray> ray;             /**< Next ray to extend the path with*/
+    std::vector<Vec3> throughput;     /**< Weight of light reaching the path*/
+    std::vector<uint32_t> sample;     /**< Camera sample of the batch the
+                                           path adds its light to*/
+    std::vector<int> depth;           /**< Bounces left after the next hit*/
+    std::vector<float> bsdf_pdf;      /**< Pdf the ray was sampled with, 0 for
+                                           camera rays and delta bounces*/
+    std::vector<Sampler> sampler;     /**< Sampler of the camera sample*/
+    std::vector<IntersectionOut> hit; /**< Result of the extend stage*/
+    std::vector<AbstractShape *> shape; /**< Shape hit by the extend stage*/
+
+    size_t size() const { return ray.size(); }
+
+    void clear() {
+        ray.clear();
+        throughput.clear();
+        sample.clear();
+        depth.clear();
+        bsdf_pdf.clear();
+        sampler.clear();
+        hit.clear();
+        shape.clear();
+    }
 
-            for (int sample = 0; sample < num_samples; sample++) {
+    void push(const Ray &r, const Vec3 &t, uint32_t s, int d, float pdf,
+              const Sampler &g) {
+        ray.push_back(r);
+        throughput.push_back(t);
+        sample.push_back(s);
+        depth.push_back(d);
+        bsdf_pdf.push_back(pdf);
+        sampler.push_back(g);
+    }
+};
 
-                v = 1 -
-                    (float)(j + 2 * random_generator.GenerateUniformFloat() -
-                            1) /
-                        out_height;
-                u = (float)(i + 2 * random_generator.GenerateUniformFloat() -
-                            1) /
-                    out_width;
+/*************************************
+ * Shadow rays queued by the shade stage for the connect stage
+ *************************************/
+struct ShadowQueue {
+    std::vector<Ray> ray;           /**< Ray towards the light sample*/
+    std::vector<float> max_dist;    /**< Distance that must stay unblocked*/
+    std::vector<Vec3> contribution; /**< Light added if unblocked*/
+    std::vector<uint32_t> sample;   /**< Camera sample the light adds to*/
+
+    size_t size() const { return ray.size(); }
+
+    void clear() {
+        ray.clear();
+        max_dist.clear();
+        contribution.clear();
+        sample.clear();
+    }
+};
 
-                const Ray ray = camera.generate_ray(u, v, random_generator);
-                auto hit = closestIntersect(shapes, ray);
+/****************************************************************************************
+ * @brief Renders tiles of the image until none are left, tracing the samples
+ * of a tile as batches of paths
+ * Each pass extends every queued path by one ray in packets of four, adds the
+ * environment for paths that escaped, shades the hits grouped by material,
+ * traces the shadow rays of their light samples and queues the surviving
+ * paths for the next pass. Film statistics only change once a batch is done,
+ * so pixels that converged are dropped at the start of each batch.
+ *****************************************************************************************/
+void Renderer::render_thread_wavefront(Camera camera, const SceneBVH &scene,
+                                       const EmitterList &emitters,
+                                       const Sampler &sampler, Film &film,
+                                       std::atomic<int> &next_tile,
+                                       ThreadProgress &progress,
+                                       int first_sample, int last_sample,
+                                       int depth) {
+    int out_width = film.width, out_height = film.height;
+
+    int tiles_x = (out_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (out_height + TILE_SIZE - 1) / TILE_SIZE;
+    int num_tiles = tiles_x * tiles_y;
+
+    PathQueue queue, next;
+    ShadowQueue shadows;
+    std::vector<uint32_t> order, bucket_start;
+    std::vector<int> bucket;
+    std::vector<AbstractMaterial *> materials;
+    std::vector<Vec3> color(WAVEFRONT_BATCH);
+    std::vector<char> converged(TILE_SIZE * TILE_SIZE);
+
+    // Pixels never count as converged unless adaptive sampling is on
+    int min_samples = std::max(2, adaptive_min_samples);
+
+    for (int tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+        int x0 = (tile % tiles_x) * TILE_SIZE;
+        int y0 = (tile / tiles_x) * TILE_SIZE;
+        int x1 = std::min(x0 + TILE_SIZE, out_width);
+        int y1 = std::min(y0 + TILE_SIZE, out_height);
+        int tile_width = x1 - x0, tile_height = y1 - y0;
+        int tile_pixels = tile_width * tile_height;
+
+        // Light is gathered per camera sample, so the film gets each sample
+        // on its own once the batch is done
+        int batch_samples = std::max(1, WAVEFRONT_BATCH / tile_pixels);
+        for (int s0 = first_sample; s0 < last_sample; s0 += batch_samples) {
+            int s1 = std::min(s0 + batch_samples, last_sample);
+            std::fill(color.begin(), color.begin() + (s1 - s0) * tile_pixels,
+                      Vec3(0, 0, 0));
+
+            // Convergence is judged per 2x2 quad, as in render_thread
+            for (int j = 0; j < tile_height; j += 2)
+                for (int i = 0; i < tile_width; i += 2) {
+                    int lanes = 0;
+                    PixelStats *stats[4];
+                    for (int k = 0; k < 4; k++) {
+                        int pi = i + (k & 1), pj = j + (k >> 1);
+                        if (pi < tile_width && pj < tile_height) {
+                            lanes |= 1 << k;
+                            stats[k] = &film.stats[out_width * (y0 + pj) +
+                                                   x0 + pi];
+                        }
+                    }
+                    int done = converged_lanes(stats, lanes, min_samples,
+                                               adaptive_threshold);
+                    for (int k = 0; k < 4; k++)
+                        if (lanes & (1 << k))
+                            converged[(j + (k >> 1)) * tile_width + i +
+                                      (k & 1)] = (done >> k) & 1;
+                }
 
-                IntersectionOut &details = hit.second;
+            // Generate: camera rays in 2x2 pixel quads, so each group of four
+            // queue entries forms a coherent packet
+            queue.clear();
+            for (int sample = s0; sample < s1; sample++)
+                for (int j = 0; j < tile_height; j += 2)
+                    for (int i = 0; i < tile_width; i += 2)
+                        for (int k = 0; k < 4; k++) {
+                            int pi = i + (k & 1), pj = j + (k >> 1);
+                            if (pi >= tile_width || pj >= tile_height ||
+                                converged[pj * tile_width + pi])
+                                continue;
+                            Sampler path_sampler = sampler;
+                            path_sampler.start_sample(x0 + pi, y0 + pj, sample);
+                            float jitter_u, jitter_v;
+                            path_sampler.get_2d(jitter_v, jitter_u);
+                            float v = 1 - (float)(y0 + pj + 2 * jitter_v - 1) /
+                                              out_height;
+                            float u = (float)(x0 + pi + 2 * jitter_u - 1) /
+                                      out_width;
+                            Ray ray = camera.generate_ray(u, v, path_sampler);
+                            queue.push(ray, Vec3(1, 1, 1),
+                                       (sample - s0) * tile_pixels +
+                                           pj * tile_width + pi,
+                                       depth, 0, path_sampler);
+                        }
+            progress.samples.fetch_add(queue.size(), std::memory_order_relaxed);
+            progress.skipped.fetch_add(
+                uint64_t(s1 - s0) * tile_pixels - queue.size(),
+                std::memory_order_relaxed);
+
+            bool camera_rays = true;
+            while (queue.size() > 0) {
+                size_t n = queue.size();
+
+                // Extend: closest hit for every path, four rays at a time
+                queue.hit.resize(n);
+                queue.shape.resize(n);
+                for (size_t i = 0; i < n; i += 4) {
+                    RayPacket packet;
+                    int lanes = 0;
+                    for (int k = 0; k < 4 && i + k < n; k++) {
+                        packet.rays[k] = queue.ray[i + k];
+                        lanes |= 1 << k;
+                    }
+                    packet.pack(lanes);
 
-                if (details.hit == true) {
-                    color =
-                        color + Renderer::illuminance(details, depth, shapes,
-                                                      random_generator);
-                } else {
-                    if (env_data) {
-                        color = color + sample_env_map(ray.direction);
-                    } else {
-                        color =
-                            color + Renderer::env_light_gradient(ray.direction);
+                    std::pair<AbstractShape *, IntersectionOut> hits[4];
+                    closestIntersect(scene, packet, hits);
+                    for (int k = 0; k < 4 && i + k < n; k++) {
+                        queue.hit[i + k] = hits[k].second;
+                        queue.shape[i + k] = hits[k].first;
                     }
                 }
-            }
+                progress.rays.fetch_add(n, std::memory_order_relaxed);
+
+                // First hit features guide the denoiser, camera rays are only
+                // queued in the first pass of the batch
+                if (camera_rays) {
+                    for (uint32_t i = 0; i < n; i++) {
+                        uint32_t p = queue.sample[i] % tile_pixels;
+                        int pix = out_width * (y0 + p / tile_width) + x0 +
+                                  p % tile_width;
+                        const IntersectionOut &first_hit = queue.hit[i];
+                        if (!first_hit.hit) {
+                            film.albedo[pix] = film.albedo[pix] + Vec3(1, 1, 1);
+                            continue;
+                        }
+                        film.albedo[pix] =
+                            film.albedo[pix] + first_hit.hit_mat->color;
+                        film.normal[pix] = film.normal[pix] + first_hit.normal;
+                        film.depth[pix] += first_hit.t;
+                    }
+                    camera_rays = false;
+                }
 
-            color = color / float(num_samples);
+                // Terminate escaped paths, bucket the rest by material with a
+                // counting sort, scenes only hold a handful of materials
+                bucket.resize(n);
+                materials.clear();
+                for (uint32_t i = 0; i < n; i++) {
+                    if (!queue.hit[i].hit) {
+                        const Vec3 &dir = queue.ray[i].direction;
+                        float weight = 1;
+                        if (queue.bsdf_pdf[i] > 0)
+                            weight = mis_weight(queue.bsdf_pdf[i],
+                                                emitters.environment_pdf(dir));
+                        color[queue.sample[i]] =
+                            color[queue.sample[i]] +
+                            queue.throughput[i] * environment(dir) * weight;
+                        bucket[i] = -1;
+                        continue;
+                    }
+                    AbstractMaterial *material = queue.hit[i].hit_mat;
+                    size_t b = std::find(materials.begin(), materials.end(),
+                                         material) -
+                               materials.begin();
+                    if (b == materials.size())
+                        materials.push_back(material);
+                    bucket[i] = b;
+                }
+                bucket_start.assign(materials.size() + 1, 0);
+                for (uint32_t i = 0; i < n; i++)
+                    if (bucket[i] >= 0)
+                        bucket_start[bucket[i] + 1]++;
+                for (size_t b = 0; b < materials.size(); b++)
+                    bucket_start[b + 1] += bucket_start[b];
+                order.resize(bucket_start.back());
+                for (uint32_t i = 0; i < n; i++)
+                    if (bucket[i] >= 0)
+                        order[bucket_start[bucket[i]]++] = i;
+
+                // Shade: add emission weighed against light sampling, sample
+                // a light and the next bounce, apply Russian roulette on the
+                // material weight
+                next.clear();
+                shadows.clear();
+                for (uint32_t i : order) {
+                    const IntersectionOut &surface = queue.hit[i];
+                    uint32_t slot = queue.sample[i];
+                    Vec3 throughput = queue.throughput[i];
+                    Sampler &path_sampler = queue.sampler[i];
+
+                    float weight = 1;
+                    if (queue.bsdf_pdf[i] > 0 && surface.hit_mat->is_emissive())
+                        weight = mis_weight(
+                            queue.bsdf_pdf[i],
+                            emitters.pdf(queue.shape[i], queue.ray[i].origin,
+                                         surface.point, surface.normal));
+                    color[slot] =
+                        color[slot] + throughput * surface.hit_mat->Le(
+                                                      surface.w0, surface.point) *
+                                         weight;
+                    if (queue.depth[i] == 0)
+                        continue;
+
+                    Ray shadow_ray;
+                    float max_dist;
+                    Vec3 contribution;
+                    if (sample_direct(surface, emitters, path_sampler,
+                                      shadow_ray, max_dist, contribution)) {
+                        shadows.ray.push_back(shadow_ray);
+                        shadows.max_dist.push_back(max_dist);
+                        shadows.contribution.push_back(throughput * contribution);
+                        shadows.sample.push_back(slot);
+                    }
 
-            color = clamp(color, Vec3(0, 0, 0), Vec3(1, 1, 1));
+                    float bsdf_pdf;
+                    Ray wi = surface.hit_mat->sample_wi(
+                        surface.w0, surface.point, surface.normal,
+                        path_sampler, bsdf_pdf);
+                    if (wi.direction == Vec3(0, 0, 0))
+                        continue;
 
-            // Converting normalized RGB to 8-bit RGB
-            data[pix * 3 + 0] = (unsigned char)(255 * pow(color.x, 1 / 1.8));
-            data[pix * 3 + 1] = (unsigned char)(255 * pow(color.y, 1 / 1.8));
-            data[pix * 3 + 2] = (unsigned char)(255 * pow(color.z, 1 / 1.8));
-        }
-    }
-}
+                    Vec3 Fr = surface.hit_mat->Fr(wi, surface.w0, surface.normal);
+                    float p = clamp(std::max(Fr.x, std::max(Fr.y, Fr.z)), 0.01, 1);
+                    if (path_sampler.get_1d() > p)
+                        continue;
 
+                    next.push(wi, throughput * Fr / p, slot, queue.depth[i] - 1,
+                              bsdf_pdf, path_sampler);
+                }
 
-/***************************************************
- * @brief Applies a simple 3x3 median filter to the image.
- * Useful for removing salt-and-pepper noise while preserving edges.
- *
- * @param data Pointer to RGB image buffer
- * @param width Image width
- * @param height Image height
- ***************************************************/
-void median_filter(unsigned char* data, int width, int height) {
-    unsigned char* temp = new unsigned char[width * height * 3];
-
-    for (int y = 1; y < height - 1; ++y) {
-        for (int x = 1; x < width - 1; ++x) {
-            unsigned char r_vals[9], g_vals[9], b_vals[9];
-            int idx = 0;
-
-            for (int ky = -1; ky <= 1; ++ky) {
-                for (int kx = -1; kx <= 1; ++kx) {
-                    int ix = x + kx;
-                    int iy = y + ky;
-                    int i = (iy * width + ix) * 3;
-                    r_vals[idx] = data[i + 0];
-                    g_vals[idx] = data[i + 1];
-                    b_vals[idx] = data[i + 2];
-                    ++idx;
+                // Connect: trace the shadow rays, add the unblocked lights
+                size_t num_shadows = shadows.size();
+                for (size_t i = 0; i < num_shadows; i += 4) {
+                    RayPacket packet;
+                    int lanes = 0;
+                    for (int k = 0; k < 4 && i + k < num_shadows; k++) {
+                        packet.rays[k] = shadows.ray[i + k];
+                        lanes |= 1 << k;
+                    }
+                    packet.pack(lanes);
+
+                    std::pair<AbstractShape *, IntersectionOut> hits[4];
+                    closestIntersect(scene, packet, hits);
+                    for (int k = 0; k < 4 && i + k < num_shadows; k++) {
+                        const IntersectionOut &blocker = hits[k].second;
+                        if (!blocker.hit || blocker.t >= shadows.max_dist[i + k])
+                            color[shadows.sample[i + k]] =
+                                color[shadows.sample[i + k]] +
+                                shadows.contribution[i + k];
+                    }
                 }
+                progress.rays.fetch_add(num_shadows, std::memory_order_relaxed);
+                std::swap(queue, next);
             }
 
-            std::sort(r_vals, r_vals + 9);
-            std::sort(g_vals, g_vals + 9);
-            std::sort(b_vals, b_vals + 9);
-
-            int id = (y * width + x) * 3;
-            temp[id + 0] = r_vals[4]; // median
-            temp[id + 1] = g_vals[4];
-            temp[id + 2] = b_vals[4];
+            for (int sample = 0; sample < s1 - s0; sample++)
+                for (int j = 0; j < tile_height; j++)
+                    for (int i = 0; i < tile_width; i++) {
+                        if (converged[j * tile_width + i])
+                            continue;
+                        int pix = out_width * (y0 + j) + x0 + i;
+                        const Vec3 &L =
+                            color[sample * tile_pixels + j * tile_width + i];
+                        film.radiance[pix] = film.radiance[pix] + L;
+                        film.stats[pix].add(luminance(L));
+                    }
         }
     }
+}
 
-    // Copy filtered data back
-    for (int i = 0; i < width * height * 3; ++i)
-        data[i] = temp[i];
+/****************************************************************************************
+ * @brief Prints progress, ETA and throughput until the render is done
+ * Reads the per thread counters at a fixed interval, so render threads never
+ * wait on it
+ *****************************************************************************************/
+void Renderer::report_progress(const std::vector<ThreadProgress> &progress,
+                               uint64_t total_samples,
+                               const std::atomic<bool> &done) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto last_report = start;
+
+    while (true) {
+        bool finished = done.load();
+        if (!finished) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (clock::now() - last_report < PROGRESS_INTERVAL)
+                continue;
+        }
+        last_report = clock::now();
+
+        uint64_t samples = 0, skipped = 0, rays = 0;
+        for (const auto &p : progress) {
+            samples += p.samples.load(std::memory_order_relaxed);
+            skipped += p.skipped.load(std::memory_order_relaxed);
+            rays += p.rays.load(std::memory_order_relaxed);
+        }
 
-    delete[] temp;
+        uint64_t completed = std::min(samples + skipped, total_samples);
+        float elapsed =
+            std::chrono::duration<float>(last_report - start).count();
+        float fraction = total_samples ? float(completed) / total_samples : 1;
+        float eta =
+            completed ? elapsed * (total_samples - completed) / completed : 0;
+
+        int bar = int(fraction * 20);
+        std::cout << "\r[" << std::string(bar, '=') << std::string(20 - bar, ' ')
+                  << "] " << std::fixed << std::setprecision(1)
+                  << 100 * fraction << "% | ETA " << eta << "s | "
+                  << samples / std::max(elapsed, 1e-3f) / 1e6
+                  << "M samples/s | " << rays / std::max(elapsed, 1e-3f) / 1e6
+                  << "M rays/s   " << std::defaultfloat;
+        std::flush(std::cout);
+
+        if (finished)
+            break;
+    }
+    std::cout << "\n";
 }
 
 
-/***************************************************
- * @brief Applies a simple 3x3 Median Filter to the image.
- * Used for optional denoising of Monte Carlo noise.
- * Using Gaussian blur because noise is uniform, it smooths out the noise without much blurring of the edges
- *
- * @param data Pointer to RGB image buffer
- * @param width Image width
- * @param height Image height
- ***************************************************/
-void gaussian_blur(unsigned char* data, int width, int height) {
-    float kernel[3][3] = {
-        {1/16.f, 2/16.f, 1/16.f},
-        {2/16.f, 4/16.f, 2/16.f},
-        {1/16.f, 2/16.f, 1/16.f}
-    };
-
-    unsigned char* temp = new unsigned char[width * height * 3];
-
-    for (int y = 1; y < height - 1; ++y) {
-        for (int x = 1; x < width - 1; ++x) {
-            float r = 0, g = 0, b = 0;
-            for (int ky = -1; ky <= 1; ++ky) {
-                for (int kx = -1; kx <= 1; ++kx) {
-                    int ix = x + kx;
-                    int iy = y + ky;
-                    int idx = (iy * width + ix) * 3;
-                    float weight = kernel[ky + 1][kx + 1];
-                    r += data[idx + 0] * weight;
-                    g += data[idx + 1] * weight;
-                    b += data[idx + 2] * weight;
-                }
-            }
-            int id = (y * width + x) * 3;
-            temp[id + 0] = static_cast<unsigned char>(r);
-            temp[id + 1] = static_cast<unsigned char>(g);
-            temp[id + 2] = static_cast<unsigned char>(b);
-        }
+/************************************************************************************
+ * @brief Resolves the film to linear RGB and writes it
+ * .hdr, .pfm and .exr files keep the linear radiance, other files are tone
+ * mapped to 8-bit and written as PNG. Post-processing runs on num_threads.
+ * @param denoise Run the feature guided denoiser on the linear image
+ ***********************************************************************************/
+static void write_image(const Film &film, const std::string &outfile,
+                        bool denoise, ToneMap curve, unsigned int num_threads) {
+    size_t num_pixels = size_t(film.width) * film.height;
+    std::vector<float> rgb(num_pixels * 3);
+    film.resolve(rgb.data());
+
+    if (denoise) {
+        std::vector<float> albedo(num_pixels * 3), normal(num_pixels * 3);
+        std::vector<float> depth(num_pixels), variance(num_pixels);
+        film.resolve_features(albedo.data(), normal.data(), depth.data(),
+                              variance.data());
+        ::denoise(rgb.data(),
+                  FeatureBuffers{albedo.data(), normal.data(), depth.data(),
+                                 variance.data()},
+                  film.width, film.height, num_threads);
     }
 
-    // Copy blurred data back
-    for (int i = 0; i < width * height * 3; ++i)
-        data[i] = temp[i];
+    if (is_hdr_image(outfile)) {
+        if (!write_hdr_image(outfile, rgb.data(), film.width, film.height))
+            std::cerr << "[Renderer] Failed to write " << outfile << "\n";
+        return;
+    }
 
-    delete[] temp;
-}
+    std::vector<unsigned char> data(num_pixels * 3);
+    tonemap(rgb.data(), data.data(), film.width, film.height, curve,
+            num_threads);
 
+    stbi_write_png(outfile.data(), film.width, film.height, 3, data.data(), 0);
+}
 
 /************************************************************************************
- * @brief Takes values of pixels from all the chunks (here,10)
+ * @brief Splits the image into tiles rendered by a pool of threads
+ * Samples are taken in passes over the whole frame, each pass adding to a
+ * float film. In progressive mode the film is written as a preview, and to
+ * the checkpoint if one is set, every few passes or seconds.
  * @return Joins all of them to give the pixel values of all the points of the
  *image.
  ***********************************************************************************/
@@ -247,41 +727,118 @@ void Renderer::render(Camera camera, const std::vector<obj_pointer> &shapes,
                       const std::string &outfile, int out_width, int out_height, int num_samples,
                       bool env_light, bool denoise) {
 
-    unsigned char *data = new unsigned char[out_width * out_height * 3];
-    Random random_generator = Random(time(nullptr));
+    SceneBVH scene;
+    scene.build(shapes);
+    EmitterList emitters;
+    emitters.build(shapes, env_data ? &env_distribution : nullptr);
+
+    // Adaptive renders take passes until the most samples a pixel may take,
+    // which replaces num_samples
+    bool adaptive = adaptive_threshold > 0;
+    int max_samples =
+        adaptive ? std::max(2, std::max(adaptive_min_samples,
+                                        adaptive_max_samples))
+                 : num_samples;
+    if (adaptive && max_samples != num_samples)
+        std::cout << "[Renderer] Adaptive sampling takes up to " << max_samples
+                  << " spp in place of the " << num_samples << " requested\n";
+    int pass_samples = progressive_samples > 0 ? progressive_samples : max_samples;
+
+    Film film;
+    uint64_t settings = render_settings_hash(camera, shapes, seed, sampler_type,
+                                             sky_top_color, sky_bottom_color);
+    if (!checkpoint_file.empty() &&
+        film.load_checkpoint(checkpoint_file, out_width, out_height,
+                             settings)) {
+        std::cout << "[Renderer] Resuming " << checkpoint_file << " after "
+                  << film.passes << " passes, " << film.next_sample
+                  << " samples\n";
+    } else {
+        film.reset(out_width, out_height, seed, settings);
+    }
+
+    // Strata and lattices cover every sample a pixel may take
+    Sampler sampler(sampler_type, film.seed, max_samples);
 
-    // NDC coordinates
-    float u, v;
     std::cout << "[Renderer] Starting render!\n";
-    std::cout << "Thread status:\n";
-    std::cout << " 0 1 2 3 4 5 6 7 8 9 \n[";
 
-    // Create 10 threads to run concurrently
+    // Create the thread pool, one thread per core unless set otherwise
     std::vector<std::thread> threads;
-    int N = 10;
+    unsigned int N = num_threads;
+    if (N == 0)
+        N = std::max(1u, std::thread::hardware_concurrency());
     threads.reserve(N);
   
     int depth = 8;
-
-    // Each thread renders 1/10th width of scene
-    for (int i = 0; i < N; i++) {
-        threads.emplace_back(
-            std::thread(render_thread, camera, std::ref(shapes), data,
-                        i * out_width / N, (i + 1) * out_width / N, out_width,
-                        out_height, num_samples, depth));
+    std::vector<ThreadProgress> progress(N);
+    std::atomic<bool> done(false);
+    // Adaptive renders report against the most samples they may take,
+    // pixels that converge count the samples they skip
+    uint64_t remaining = max_samples - std::min<uint32_t>(film.next_sample, max_samples);
+    std::thread reporter(report_progress, std::cref(progress),
+                         uint64_t(out_width) * out_height * remaining,
+                         std::cref(done));
+
+    using clock = std::chrono::steady_clock;
+    auto last_preview = clock::now();
+    int passes_since_preview = 0;
+    while (film.next_sample < uint32_t(max_samples)) {
+        int first_sample = film.next_sample;
+        int last_sample = std::min(first_sample + pass_samples, max_samples);
+
+        // Threads pull 16x16 tiles until the pass is done
+        std::atomic<int> next_tile(0);
+        threads.clear();
+        for (unsigned int i = 0; i < N; i++) {
+            threads.emplace_back(
+                std::thread(wavefront ? render_thread_wavefront : render_thread,
+                            camera, std::ref(scene), std::ref(emitters),
+                            std::cref(sampler), std::ref(film), std::ref(next_tile),
+                            std::ref(progress[i]), first_sample, last_sample,
+                            depth));
+        }
+        for (int i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        film.passes++;
+        film.next_sample = last_sample;
+
+        passes_since_preview++;
+        bool preview_due =
+            (preview_passes > 0 && passes_since_preview >= preview_passes) ||
+            (preview_seconds > 0 &&
+             std::chrono::duration<float>(clock::now() - last_preview).count() >=
+                 preview_seconds);
+        if (progressive_samples > 0 && preview_due &&
+            film.next_sample < uint32_t(max_samples)) {
+            write_image(film, outfile, false, tone_map, N);
+            if (!checkpoint_file.empty() && !film.save_checkpoint(checkpoint_file))
+                std::cerr << "\n[Renderer] Failed to write checkpoint "
+                          << checkpoint_file << "\n";
+            last_preview = clock::now();
+            passes_since_preview = 0;
+        }
     }
-    for (int i = 0; i < threads.size(); i++) {
-        threads[i].join();
+    done = true;
+    reporter.join();
+
+    if (adaptive) {
+        uint64_t samples = 0;
+        for (const PixelStats &stats : film.stats)
+            samples += stats.n;
+        std::cout << "[Renderer] Adaptive sampling averaged " << std::fixed
+                  << std::setprecision(1)
+                  << double(samples) / (uint64_t(out_width) * out_height)
+                  << " spp" << std::defaultfloat << std::endl;
     }
 
-    std::cout << "]\n";
-
-    if (denoise)
-        median_filter(data, out_width, out_height);
+    // The final checkpoint lets a later run add samples to the image
+    if (!checkpoint_file.empty() && !film.save_checkpoint(checkpoint_file))
+        std::cerr << "[Renderer] Failed to write checkpoint " << checkpoint_file
+                  << "\n";
 
     // Write data
-    stbi_write_png(outfile.data(), out_width, out_height, 3, data, 0);
-    delete[] data;
+    write_image(film, outfile, denoise, tone_map, N);
 }
 
 /**********************************************************************************
@@ -295,10 +852,92 @@ void Renderer::env_light(Vec3 sky_top_color, Vec3 sky_bottom_color)
     Renderer::sky_bottom_color = sky_bottom_color;
 }
 
+/**********************************************************************************
+ * @brief Sets the number of threads used to render
+ * @par Thread count, 0 picks one thread per hardware core
+**********************************************************************************/
+void Renderer::set_threads(unsigned int num_threads)
+{
+    Renderer::num_threads = num_threads;
+}
+
+/**********************************************************************************
+ * @brief Selects the wavefront path tracer over the recursive one
+ * @par Trace paths in batches of queued rays if true
+**********************************************************************************/
+void Renderer::set_wavefront(bool wavefront)
+{
+    Renderer::wavefront = wavefront;
+}
+
+/**********************************************************************************
+ * @brief Renders in passes, writing a preview and checkpoint as they finish
+ * @par Samples per pixel of each pass, 0 renders in a single pass
+ * @par Passes between previews, 0 for no pass based previews
+ * @par Seconds between previews, 0 for no time based previews
+**********************************************************************************/
+void Renderer::set_progressive(int pass_samples, int preview_passes,
+                               float preview_seconds)
+{
+    Renderer::progressive_samples = pass_samples;
+    Renderer::preview_passes = preview_passes;
+    Renderer::preview_seconds = preview_seconds;
+}
+
+/**********************************************************************************
+ * @brief Sets the file renders are checkpointed to and resumed from
+ * @par Checkpoint file path, empty disables checkpoints
+**********************************************************************************/
+void Renderer::set_checkpoint(const std::string &checkpoint_file)
+{
+    Renderer::checkpoint_file = checkpoint_file;
+}
+
+/**********************************************************************************
+ * @brief Sets the curve 8-bit output is tone mapped with
+ * @par Tone curve
+**********************************************************************************/
+void Renderer::set_tonemap(ToneMap curve)
+{
+    Renderer::tone_map = curve;
+}
+
+/**********************************************************************************
+ * @brief Sets the seed the random stream of every sample derives from
+ * @par Seed of new renders
+**********************************************************************************/
+void Renderer::set_seed(uint64_t seed)
+{
+    Renderer::seed = seed;
+}
+
+/**********************************************************************************
+ * @brief Sets the sequence camera samples are drawn from
+ * @par Sampler type
+**********************************************************************************/
+void Renderer::set_sampler(SamplerType type)
+{
+    Renderer::sampler_type = type;
+}
+
+/**********************************************************************************
+ * @brief Enables adaptive sampling in the recursive path tracer
+ * @par Relative standard error a pixel must fall below, 0 disables
+ * @par Samples taken before a pixel may stop
+ * @par Samples taken at most by noisy pixels
+**********************************************************************************/
+void Renderer::set_adaptive(float threshold, int min_samples, int max_samples)
+{
+    Renderer::adaptive_threshold = threshold;
+    Renderer::adaptive_min_samples = min_samples;
+    Renderer::adaptive_max_samples = max_samples;
+}
+
 /**********************************************************************************
  * @brief Loads the HDR file and stores it in env_data as float* array
  * @par Environment file path
  * Also initiates the env_depth , env_height and env_channels( here 3 for RGB )
+ * and builds env_distribution for importance sampling
  **********************************************************************************/
 void Renderer::env_map(const std::string &envmap_file_path) {
     stbi_set_flip_vertically_on_load(true);
@@ -310,30 +949,77 @@ void Renderer::env_map(const std::string &envmap_file_path) {
         std::cerr << "Failed to load HDR environment map\n";
         exit(1);
     }
+    env_distribution.build(env_data, env_width, env_height, env_channels);
+}
+
+/********************************************************************************
+ * @brief Samples light reaching a surface straight from an emitter
+ * The sample is weighed against the material picking the same direction.
+ * @return False if no light sample can reach the surface, else the shadow
+ * ray, the distance it must stay unblocked for and the unoccluded light
+ ********************************************************************************/
+bool Renderer::sample_direct(const IntersectionOut &surface,
+                             const EmitterList &emitters,
+                             Sampler &sampler, Ray &shadow_ray,
+                             float &max_dist, Vec3 &contribution) {
+    LightSample light;
+    if (!emitters.sample(surface.point, sampler, light))
+        return false;
+
+    Ray wi(surface.point, light.wi);
+    Vec3 f = surface.hit_mat->eval(wi, surface.w0, surface.normal);
+    if (f == Vec3(0, 0, 0))
+        return false;
+
+    float weight = mis_weight(
+        light.pdf, surface.hit_mat->pdf(wi, surface.w0, surface.normal));
+    contribution = f * light.Le * (weight / light.pdf);
+
+    float side = dot(light.wi, surface.normal) > 0 ? 1e-4f : -1e-4f;
+    shadow_ray = Ray(surface.point + surface.normal * side, light.wi);
+    max_dist = light.dist * (1 - SHADOW_EPSILON);
+    return true;
 }
 
 /********************************************************************************
  * @return Gives Lr (additional light) by approximating over all the directions
- * @return Gives Le (light emitted by the object)
- * @return Adds Lr and Le to give all the light that reaches the eye
+ * @return Gives Ld (light sampled directly from the emitters)
+ * @return Gives Le (light emitted by the object), weighted against light sampling
+ * @return Adds Lr, Ld and Le to give all the light that reaches the eye
  ********************************************************************************/
-Vec3 Renderer::illuminance(const IntersectionOut &surface, int max_depth,
-                           const std::vector<obj_pointer> &shapes,
-                           Random &random_generator) {
-    Vec3 Le = surface.hit_mat->Le(surface.w0, surface.point);
+Vec3 Renderer::illuminance(const IntersectionOut &surface,
+                           float emission_weight, int max_depth,
+                           const SceneBVH &scene, const EmitterList &emitters,
+                           Sampler &sampler, uint64_t &rays) {
+    Vec3 Le = surface.hit_mat->Le(surface.w0, surface.point) * emission_weight;
 
     // If max_depth has been reached give material emission colour
     if (max_depth == 0)
         return Le;
 
+    // Next event estimation: connect to a point on an emitter
+    Vec3 Ld = Vec3(0, 0, 0);
+    Ray shadow_ray;
+    float max_dist;
+    Vec3 contribution;
+    if (sample_direct(surface, emitters, sampler, shadow_ray,
+                      max_dist, contribution)) {
+        auto blocker = closestIntersect(scene, shadow_ray);
+        rays++;
+        if (!blocker.second.hit || blocker.second.t >= max_dist)
+            Ld = contribution;
+    }
+
     // Else pick random vector according to material
-    // TODO: Implement BRDF
+    float bsdf_pdf;
     Ray wi = surface.hit_mat->sample_wi(surface.w0, surface.point,
-                                        surface.normal, random_generator);
+                                        surface.normal, sampler,
+                                        bsdf_pdf);
     if (wi.direction == Vec3(0, 0, 0))
-        return Le;
+        return Le + Ld;
 
-    auto hit = closestIntersect(shapes, wi);
+    auto hit = closestIntersect(scene, wi);
+    rays++;
     IntersectionOut &details = hit.second;
 
     Vec3 Li = Vec3(0, 0, 0);
@@ -345,25 +1031,34 @@ Vec3 Renderer::illuminance(const IntersectionOut &surface, int max_depth,
     // Use larger number of samples to remove "sparkles"
     float p = clamp(std::max(Fr.x, std::max(Fr.y, Fr.z)), 0.01, 1);
 
-    if (random_generator.GenerateUniformFloat() > p)
-        return Vec3(0,0,0);
+    if (sampler.get_1d() > p)
+        return Le + Ld;
 
     // Calculate luminance of hit point else assume no light
     if (details.hit) {
+        // Emitters found by the bounce are weighed against light sampling,
+        // bounces out of delta lobes cannot be light sampled
+        float weight = 1;
+        if (bsdf_pdf > 0 && details.hit_mat->is_emissive())
+            weight = mis_weight(bsdf_pdf,
+                                emitters.pdf(hit.first, surface.point,
+                                             details.point, details.normal));
+
         // Darker light -> More chance of skipping
-        Li = illuminance(details, max_depth - 1, shapes, random_generator);
+        Li = illuminance(details, weight, max_depth - 1, scene, emitters,
+                         sampler, rays);
     } else {
-        if (env_data) {
-            Li = sample_env_map(wi.direction);
-        } else {
-            Li = env_light_gradient(wi.direction);
-        }
+        // Escaping directions are weighed against sampling the environment
+        float weight = 1;
+        if (bsdf_pdf > 0)
+            weight = mis_weight(bsdf_pdf, emitters.environment_pdf(wi.direction));
+        Li = environment(wi.direction) * weight;
     }
 
     Vec3 Lr = Fr * Li / p;
 
     // Return monte-carlo sample
-    return Le + Lr;
+    return Le + Ld + Lr;
 }
 
 /**************************************************
@@ -373,6 +1068,7 @@ void Renderer::cleanup() {
     if (env_data != nullptr) {
         stbi_image_free(env_data);
         env_data = nullptr;
+        env_distribution.clear();
 
         // Optional: Reset metadata
         env_width = 0;
@@ -1,8 +1,15 @@
 #pragma once
 
+#include "bvh.h"
 #include "camera.h"
+#include "emitters.h"
+#include "film.h"
+#include "image.h"
 #include "material.h"
 #include "objects.h"
+#include "sampler.h"
+#include <atomic>
+#include <cstdint>
 #include <vector>
 
 /***********************
@@ -14,12 +21,15 @@ public:
      * @brief Static function to render scene using a basic path tracer
      * @param camera The camera to render scene through
      * @param shapes List of shared pointers to the shapes to render
-     * @param outfile Filename for output file (.png)
+     * @param outfile Filename for output file (.png, or .hdr, .pfm and .exr
+     *for linear radiance)
      * @param out_width Width of output file in pixels
      * @param out_height Height of output file in pixels
-     * @param num_spp Number of samples for Monte Carlo Estimator
+     * @param num_spp Number of samples for Monte Carlo Estimator, replaced
+     *by the most samples a pixel may take when adaptive sampling is on
      * @param env_light Use environment light if true and environment map if
      *false
+     * @param denoise Filter the result with the feature guided denoiser
      **********************/
     static void render(Camera camera, const std::vector<obj_pointer> &shapes,
                        const std::string &outfile, int out_width,
@@ -34,9 +44,88 @@ public:
 
     /**********************************************************************************
      * @brief Loads the HDR file and stores it internally
+     * Also builds the distribution used to importance sample it
      * @param envmap_file_path Environment file path
      **********************************************************************************/
     static void env_map(const std::string& envmap_file_path);
+
+    /**********************************************************************************
+     * @brief Pdf of the environment map sampling strategy
+     * Light sampling picks directions in proportion to the map luminance.
+     * @param dir Direction towards the environment
+     * @return Solid angle pdf, 0 if no environment map is loaded
+     **********************************************************************************/
+    static float env_pdf(const Vec3 &dir);
+
+    /**********************************************************************************
+     * @brief Sets the number of threads used to render
+     * @param num_threads Thread count, 0 uses std::thread::hardware_concurrency()
+     **********************************************************************************/
+    static void set_threads(unsigned int num_threads);
+
+    /**********************************************************************************
+     * @brief Selects the wavefront path tracer over the recursive one
+     * @param wavefront Trace paths in batches of queued rays if true
+     **********************************************************************************/
+    static void set_wavefront(bool wavefront);
+
+    /**********************************************************************************
+     * @brief Lets pixels stop sampling once their estimate has converged
+     * Pixels take between min_samples and max_samples, stopping when the
+     * standard error of their luminance relative to its mean drops below the
+     * threshold. While it is on, max_samples replaces the num_spp given to
+     * render. The wavefront tracer checks convergence once per batch of
+     * samples, so its pixels may overshoot by part of a batch.
+     * @param threshold Relative error a pixel must fall below, 0 disables
+     * @param min_samples Samples every pixel takes before it may stop
+     * @param max_samples Samples noisy pixels take at most
+     **********************************************************************************/
+    static void set_adaptive(float threshold, int min_samples, int max_samples);
+
+    /**********************************************************************************
+     * @brief Renders the frame in passes of a few samples per pixel
+     * The output file is rewritten as a preview whenever enough passes or
+     * seconds have gone by, along with the checkpoint if one is set.
+     * @param pass_samples Samples per pixel of each pass, 0 renders in one pass
+     * @param preview_passes Passes between previews, 0 for none
+     * @param preview_seconds Seconds between previews, 0 for none
+     **********************************************************************************/
+    static void set_progressive(int pass_samples, int preview_passes,
+                                float preview_seconds);
+
+    /**********************************************************************************
+     * @brief Sets the file renders are checkpointed to and resumed from
+     * The checkpoint holds the accumulated radiance, per pixel sample counts
+     * and the seed and sample index the random streams continue from. A
+     * render of the same size, scene, seed and sampler resumes from it if it
+     * exists, and a finished render still writes it so a later run can add
+     * samples.
+     * @param checkpoint_file Checkpoint path, empty disables checkpoints
+     **********************************************************************************/
+    static void set_checkpoint(const std::string &checkpoint_file);
+
+    /**********************************************************************************
+     * @brief Sets the curve 8-bit output is tone mapped with
+     * HDR outputs are always written as linear radiance.
+     * @param curve Tone curve, ToneMap::Gamma by default
+     **********************************************************************************/
+    static void set_tonemap(ToneMap curve);
+
+    /**********************************************************************************
+     * @brief Sets the seed the random stream of every sample derives from
+     * Renders with the same seed and settings give the same image whatever
+     * the thread count. Resumed renders keep the seed of their checkpoint.
+     * @param seed Seed, 0 by default
+     **********************************************************************************/
+    static void set_seed(uint64_t seed);
+
+    /**********************************************************************************
+     * @brief Sets the sequence camera samples are drawn from
+     * Low discrepancy samplers cover the dimensions of a pixel more evenly
+     * than independent numbers, so the same noise takes fewer samples.
+     * @param type Sampler, SamplerType::Sobol by default
+     **********************************************************************************/
+    static void set_sampler(SamplerType type);
     
     /**********************************************************************************
      * @brief Frees up allocated memory
@@ -44,14 +133,56 @@ public:
     static void cleanup(); 
 
 private:
-    static void render_thread(Camera camera, const std::vector<obj_pointer> &shapes,
-                              unsigned char *data, int w1, int w2, int out_width,
-                              int out_height, int num_samples, int depth);
+    /**********************************************************************************
+     * Counters written by one render thread and read by the progress reporter,
+     * padded to a cache line so threads never share one
+     **********************************************************************************/
+    struct alignas(64) ThreadProgress {
+        std::atomic<uint64_t> samples{0}; /**< Camera samples traced*/
+        std::atomic<uint64_t> rays{0};    /**< Rays cast into the scene*/
+        std::atomic<uint64_t> skipped{0}; /**< Samples converged pixels no
+                                               longer take*/
+    };
+
+    static void render_thread(Camera camera, const SceneBVH &scene,
+                              const EmitterList &emitters,
+                              const Sampler &sampler, Film &film,
+                              std::atomic<int> &next_tile,
+                              ThreadProgress &progress, int first_sample,
+                              int last_sample, int depth);
+    static void render_thread_wavefront(Camera camera, const SceneBVH &scene,
+                                        const EmitterList &emitters,
+                                        const Sampler &sampler, Film &film,
+                                        std::atomic<int> &next_tile,
+                                        ThreadProgress &progress,
+                                        int first_sample, int last_sample,
+                                        int depth);
+    static void report_progress(const std::vector<ThreadProgress> &progress,
+                                uint64_t total_samples,
+                                const std::atomic<bool> &done);
     static Vec3 env_light_gradient(const Vec3& dir);
-    static Vec3 illuminance(const IntersectionOut &surface, int max_depth,
-                            const std::vector<obj_pointer> &shapes,
-                            Random &radom_generator);
+    static Vec3 environment(const Vec3 &dir);
+    static Vec3 illuminance(const IntersectionOut &surface,
+                            float emission_weight, int max_depth,
+                            const SceneBVH &scene, const EmitterList &emitters,
+                            Sampler &sampler, uint64_t &rays);
+    static bool sample_direct(const IntersectionOut &surface,
+                              const EmitterList &emitters,
+                              Sampler &sampler, Ray &shadow_ray,
+                              float &max_dist, Vec3 &contribution);
                             
     static Vec3 sky_top_color;
     static Vec3 sky_bottom_color;
+    static unsigned int num_threads;
+    static bool wavefront;
+    static float adaptive_threshold;
+    static int adaptive_min_samples;
+    static int adaptive_max_samples;
+    static int progressive_samples;
+    static int preview_passes;
+    static float preview_seconds;
+    static std::string checkpoint_file;
+    static ToneMap tone_map;
+    static uint64_t seed;
+    static SamplerType sampler_type;
 };
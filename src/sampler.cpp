@@ -0,0 +1,401 @@
+#include "sampler.h"
+#include "math.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+/*************************************
+ * Side of the tiling blue noise mask, a power of two
+ *************************************/
+constexpr int BLUE_NOISE_SIZE = 64;
+
+/*************************************
+ * Width in pixels of the Gaussian the void-and-cluster energy is measured
+ * with
+ *************************************/
+constexpr float BLUE_NOISE_SIGMA = 1.5f;
+
+/*************************************
+ * Seed of the initial pattern of the blue noise mask
+ *************************************/
+constexpr uint64_t BLUE_NOISE_SEED = 0x5EEDB10Eull;
+
+/*************************************
+ * Direction numbers of the second Sobol dimension, the first one is the
+ * bit reversed index
+ *************************************/
+struct SobolDirections {
+    uint32_t v[32];
+    constexpr SobolDirections() : v() {
+        v[0] = 1u << 31;
+        for (int i = 1; i < 32; i++)
+            v[i] = v[i - 1] ^ (v[i - 1] >> 1);
+    }
+};
+static constexpr SobolDirections SOBOL_DIRECTIONS;
+
+/*************************************
+ * Hash of a key and two small integers
+ *************************************/
+static inline uint32_t hash(uint64_t key, uint32_t a, uint32_t b = 0) {
+    return uint32_t(mix64(key + (uint64_t(a) << 32 | b) * 0x9E3779B97F4A7C15ull));
+}
+
+/*************************************
+ * Maps 32 bits to a float in [0, 1), dropping the bits a float cannot hold
+ *************************************/
+static inline float to_unit_float(uint32_t x) { return (x >> 8) * 0x1p-24f; }
+
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+    x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+    return x;
+}
+
+/*************************************
+ * Hash based Owen scramble (Burley, "Practical Hash-based Owen Scrambling")
+ * Each bit is flipped by a hash of the bits above it, so points in the same
+ * power of two interval stay together.
+ *************************************/
+static inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverse_bits(x);
+}
+
+static inline uint32_t sobol_second_dimension(uint32_t index) {
+    uint32_t x = 0;
+    for (int bit = 0; index; bit++, index >>= 1)
+        if (index & 1)
+            x ^= SOBOL_DIRECTIONS.v[bit];
+    return x;
+}
+
+/*************************************
+ * Pseudo random permutation of [0, length) (Kensler, "Correlated
+ * Multi-Jittered Sampling"), a hash of the bits below the next power of two
+ * is repeated until it lands in range
+ *************************************/
+static uint32_t permute(uint32_t i, uint32_t length, uint32_t p) {
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xE170893Du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929EB3Fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935FA69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74DCB303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9E501CC3u;
+        i ^= (i & w) >> 2;
+        i *= 0xC860A3DFu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + p) % length;
+}
+
+/*************************************
+ * Void-and-cluster blue noise mask (Ulichney), values are the ranks of
+ * the pixels spread over (0, 1)
+ *************************************/
+static std::vector<float> build_blue_noise() {
+    const int size = BLUE_NOISE_SIZE, mask = size - 1, n = size * size;
+
+    // Energy a point adds to the pixels around it, on a torus so the mask
+    // tiles
+    std::vector<float> kernel(n);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++) {
+            int dx = std::min(x, size - x), dy = std::min(y, size - y);
+            kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) /
+                                            (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+
+    std::vector<char> pattern(n, 0);
+    std::vector<float> energy(n, 0);
+    auto splat = [&](int p, float sign) {
+        int px = p % size, py = p / size;
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+                energy[y * size + x] +=
+                    sign * kernel[((y - py) & mask) * size + ((x - px) & mask)];
+    };
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int p = 0; p < n; p++)
+            if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        return best;
+    };
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int p = 0; p < n; p++)
+            if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        return best;
+    };
+
+    // Spread a tenth of the pixels evenly by moving the most crowded point
+    // into the largest gap until it stays put
+    Random random(BLUE_NOISE_SEED);
+    int initial = n / 10;
+    for (int placed = 0; placed < initial;) {
+        int p = random.GenerateUniformInt() % n;
+        if (!pattern[p]) {
+            pattern[p] = 1;
+            splat(p, 1);
+            placed++;
+        }
+    }
+    for (int moves = 0; moves < n; moves++) {
+        int cluster = tightest_cluster();
+        pattern[cluster] = 0;
+        splat(cluster, -1);
+        int gap = largest_void();
+        pattern[gap] = 1;
+        splat(gap, 1);
+        if (gap == cluster)
+            break;
+    }
+
+    // Rank the initial points from the most crowded down, then fill the
+    // remaining pixels largest gap first
+    std::vector<int> rank(n);
+    std::vector<char> initial_pattern = pattern;
+    std::vector<float> initial_energy = energy;
+    for (int r = initial - 1; r >= 0; r--) {
+        int cluster = tightest_cluster();
+        pattern[cluster] = 0;
+        splat(cluster, -1);
+        rank[cluster] = r;
+    }
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (int r = initial; r < n; r++) {
+        int gap = largest_void();
+        pattern[gap] = 1;
+        splat(gap, 1);
+        rank[gap] = r;
+    }
+
+    std::vector<float> values(n);
+    for (int p = 0; p < n; p++)
+        values[p] = (rank[p] + 0.5f) / n;
+    return values;
+}
+
+/*************************************
+ * Blue noise mask shared by all samplers, built on first use
+ *************************************/
+static const std::vector<float> &blue_noise() {
+    static const std::vector<float> mask = build_blue_noise();
+    return mask;
+}
+
+Sampler::Sampler(SamplerType type, uint64_t seed, uint32_t samples_per_pixel)
+    : type(type), seed(seed),
+      samples_per_pixel(std::max(1u, samples_per_pixel)), lattice_generator(1),
+      pixel_key(0), pixel_x(0), pixel_y(0), sample(0), dimension(0) {
+    // Korobov lattice along the golden ratio, close to a Fibonacci lattice
+    // for any number of points
+    if (this->samples_per_pixel > 2) {
+        uint32_t n = this->samples_per_pixel;
+        lattice_generator = std::max(1u, uint32_t(std::lround(n * 0.6180339887)));
+        while (std::gcd(lattice_generator, n) != 1)
+            lattice_generator++;
+    }
+    // Build the mask up front rather than in the first render thread
+    if (type == SamplerType::BlueNoise)
+        blue_noise();
+}
+
+void Sampler::start_sample(int x, int y, uint32_t sample) {
+    pixel_x = x;
+    pixel_y = y;
+    this->sample = sample;
+    dimension = 0;
+    pixel_key = mix64(seed + (uint64_t(uint32_t(y)) << 32 | uint32_t(x)) *
+                                 0x9E3779B97F4A7C15ull);
+    random = Random(mix64(pixel_key ^ sample), pixel_key);
+}
+
+float Sampler::get_1d() {
+    uint32_t d = dimension++;
+    uint32_t n = samples_per_pixel;
+    uint32_t round = sample / n, index = sample % n;
+
+    switch (type) {
+    case SamplerType::Stratified: {
+        uint32_t stratum = permute(index, n, hash(pixel_key, d, round));
+        return std::min((stratum + random.GenerateUniformFloat()) / n,
+                        0x1.fffffep-1f);
+    }
+    case SamplerType::Sobol: {
+        uint32_t shuffled = owen_scramble(sample, hash(pixel_key, d));
+        return to_unit_float(
+            owen_scramble(reverse_bits(shuffled), hash(pixel_key, d, 1)));
+    }
+    case SamplerType::BlueNoise: {
+        // Every pixel walks the lattice in the same order, only the shift
+        // differs between neighbours
+        uint32_t i = permute(index, n, hash(seed, d, round));
+        uint32_t offset = hash(seed + 1, d, round);
+        float shift = blue_noise()[((pixel_y + (offset >> 16)) & (BLUE_NOISE_SIZE - 1)) *
+                                       BLUE_NOISE_SIZE +
+                                   ((pixel_x + offset) & (BLUE_NOISE_SIZE - 1))];
+        float u = float(i) / n + shift;
+        return std::min(u - std::floor(u), 0x1.fffffep-1f);
+    }
+    default:
+        return random.GenerateUniformFloat();
+    }
+}
+
+void Sampler::get_2d(float &u, float &v) {
+    uint32_t d = dimension;
+    dimension += 2;
+    uint32_t n = samples_per_pixel;
+    uint32_t round = sample / n, index = sample % n;
+
+    switch (type) {
+    case SamplerType::Stratified: {
+        // Correlated multi-jittered sampling: strata in a m x k grid, each
+        // column and row keeping one sample
+        uint32_t p = hash(pixel_key, d, round);
+        uint32_t m = std::max(1u, uint32_t(std::sqrt(float(n)))), k = (n + m - 1) / m;
+        uint32_t s = permute(index, n, p * 0x51633E2Du);
+        uint32_t sx = permute(s % m, m, p * 0x68BC21EBu);
+        uint32_t sy = permute(s / m, k, p * 0x02E5BE93u);
+        float jx = random.GenerateUniformFloat(), jy = random.GenerateUniformFloat();
+        u = std::min((sx + (sy + jx) / k) / m, 0x1.fffffep-1f);
+        v = std::min((s + jy) / n, 0x1.fffffep-1f);
+        return;
+    }
+    case SamplerType::Sobol: {
+        // Padded 2D Sobol points, the index is shuffled per pair of
+        // dimensions so pairs are not correlated with each other
+        uint32_t shuffled = owen_scramble(sample, hash(pixel_key, d));
+        u = to_unit_float(
+            owen_scramble(reverse_bits(shuffled), hash(pixel_key, d, 1)));
+        v = to_unit_float(owen_scramble(sobol_second_dimension(shuffled),
+                                        hash(pixel_key, d, 2)));
+        return;
+    }
+    case SamplerType::BlueNoise: {
+        uint32_t i = permute(index, n, hash(seed, d, round));
+        const std::vector<float> &mask = blue_noise();
+        auto shift = [&](uint32_t offset) {
+            return mask[((pixel_y + (offset >> 16)) & (BLUE_NOISE_SIZE - 1)) *
+                            BLUE_NOISE_SIZE +
+                        ((pixel_x + offset) & (BLUE_NOISE_SIZE - 1))];
+        };
+        u = float(i) / n + shift(hash(seed + 1, d, round));
+        v = float(uint64_t(i) * lattice_generator % n) / n +
+            shift(hash(seed + 2, d, round));
+        u = std::min(u - std::floor(u), 0x1.fffffep-1f);
+        v = std::min(v - std::floor(v), 0x1.fffffep-1f);
+        return;
+    }
+    default:
+        u = random.GenerateUniformFloat();
+        v = random.GenerateUniformFloat();
+    }
+}
+
+/****************************
+ * Generates a point on a disc of radius 1
+ * Uses the concentric mapping, which keeps stratified points apart better
+ * than taking the square root of the radius
+ * @return point from a disc of radius 1
+ * ****************************/
+Vec3 Sampler::GenerateUniformPointDisc() {
+    float u, v;
+    get_2d(u, v);
+    float a = 2 * u - 1, b = 2 * v - 1;
+    if (a == 0 && b == 0)
+        return Vec3(0, 0, 0);
+
+    float r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = float(M_PI / 4) * (b / a);
+    } else {
+        r = b;
+        theta = float(M_PI / 2) - float(M_PI / 4) * (a / b);
+    }
+    return Vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+/*********************
+ * Generates a point on a sphere of radius 1
+ * @return point on sphere of radius 1
+ *******************/
+Vec3 Sampler::GenerateUniformPointSphere() {
+    float u, v;
+    get_2d(u, v);
+
+    float theta = u * 2 * M_PI;                         // Using Spherical polar coordinates
+    float cos_phi = 2 * v - 1;
+    float sin_phi = std::sqrt(1 - cos_phi * cos_phi);
+
+    Vec3 ret;
+
+    ret.x = cos_phi;
+    ret.y = std::sin(theta) * sin_phi;
+    ret.z = std::cos(theta) * sin_phi;
+    return ret;
+}
+
+/*****************************
+ *  Generates a point on a hemisphere around a normal vector
+ * @par n ,A 3D vector representing a normal passing through hemisphere
+ * @return point on the hemisphere
+ *  */
+Vec3 Sampler::GenerateUniformPointHemisphere(const Vec3 &n) {
+    Vec3 ret = GenerateUniformPointSphere();
+    float factor = dot(ret, n) > 0 ? 1 : -1;
+
+    return ret * factor;
+}
+
+// Generate a point on a hemisphere around a normal vector
+Vec3 Sampler::GenerateCosinePointHemisphere(const Vec3 &n) {
+    Vec3 ret = GenerateUniformPointDisc();
+    ret.z = std::sqrt(std::max(0.0f, 1 - dot(ret, ret)));
+
+    float c1 = 1 / (1 + n.z);
+    float c2 = n.y * c1;
+    float c3 = n.x * c1;
+    Mat3 m{};
+    m[0][0] = 1 - n.x * c3;
+    m[0][1] = -n.x * c2;
+    m[0][2] = n.x;
+    m[1][0] = -n.x * c2;
+    m[1][1] = 1 - n.y * c2;
+    m[1][2] = n.y;
+    m[2][0] = -n.x;
+    m[2][1] = -n.y;
+    m[2][2] = n.z;
+
+    return m * ret;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include "math.h"
+#include "random.h"
+#include <cstdint>
+
+/***********************************
+ * Sequences the samples of a pixel are drawn from
+ ***********************************/
+enum struct SamplerType {
+    Independent, /**< Uniform random numbers, error falls as O(N^-1/2)*/
+    Stratified,  /**< Correlated multi-jittered strata over the samples of
+                      a pixel*/
+    Sobol,       /**< Owen scrambled Sobol points, padded across dimensions*/
+    BlueNoise    /**< Rank-1 lattice shifted per pixel by a blue noise mask,
+                      so the remaining error looks like blue noise*/
+};
+
+/**************************************
+ * Source of the numbers a camera sample is built from
+ * Every sample starts at the first dimension and each request takes the
+ * next one or two, so the same decision of every sample of a pixel reads
+ * the same dimension of a low discrepancy sequence. The state is small and
+ * copyable, so wavefront paths carry their sampler along.
+ **************************************/
+class Sampler {
+  private:
+    SamplerType type;           /**< Sequence the points come from*/
+    uint64_t seed;              /**< Seed of the render*/
+    uint32_t samples_per_pixel; /**< Samples the strata and lattices cover*/
+    uint32_t lattice_generator; /**< Generator of the rank-1 lattice*/
+    uint64_t pixel_key;         /**< Hash of the seed and the pixel*/
+    int pixel_x, pixel_y;       /**< Pixel of the current sample*/
+    uint32_t sample;            /**< Index of the current sample*/
+    uint32_t dimension;         /**< Next dimension to hand out*/
+    Random random;              /**< Independent numbers and jitter*/
+
+  public:
+    /**************************************
+     * @brief Constructor
+     * @param type Sequence the points come from
+     * @param seed Seed of the render, scrambles and shifts derive from it
+     * @param samples_per_pixel Samples taken per pixel, strata and lattices
+     * cover this many and start over with new shifts past it
+     ***************************************/
+    Sampler(SamplerType type = SamplerType::Independent, uint64_t seed = 0,
+            uint32_t samples_per_pixel = 1);
+
+    /**************************************
+     * @brief Moves to a sample of a pixel, restarting at the first dimension
+     ***************************************/
+    void start_sample(int x, int y, uint32_t sample);
+
+    /**************************************************************
+     * @brief Next dimension of the sample
+     * @return A float in [0, 1)
+     ***************************************************************/
+    float get_1d();
+
+    /**************************************************************
+     * @brief Next two dimensions of the sample, stratified together
+     * @param u, v Floats in [0, 1)
+     ***************************************************************/
+    void get_2d(float &u, float &v);
+
+    /*****************************************
+     * Generates a point in a unit disc
+     * @return A point in the unit disc as (x, y, 0)
+     *****************************************/
+    Vec3 GenerateUniformPointDisc();
+
+    /*******************************************
+     * Generate a point on a unit sphere
+     * @return A point on the unit sphere
+     *******************************************/
+    Vec3 GenerateUniformPointSphere();
+
+    /**********************************************************************
+     * Generate a point on a unit hemisphere with specified 'central
+     * normal' using a uniform distribution
+     * @param n The central normal of the hemisphere
+     * @return A point on the specified unit hemisphere
+     **********************************************************************/
+    Vec3 GenerateUniformPointHemisphere(const Vec3 &n);
+
+    /**********************************************************************
+     * Generate a point on a unit hemisphere with specified 'central
+     * normal' using a cosine weighted distribution
+     * @param n The central normal of the hemisphere
+     * @return A point on the specified unit hemisphere
+     **********************************************************************/
+    Vec3 GenerateCosinePointHemisphere(const Vec3 &n);
+};
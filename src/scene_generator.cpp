@@ -524,6 +524,40 @@ void generate_scene4(std::vector<obj_pointer> &shapes)
     shapes.push_back(std::move(ball));
 }
 
+// A field of teapots sharing one mesh through instances
+void generate_scene5(std::vector<obj_pointer> &shapes)
+{
+    // the teapot is loaded once, each instance only adds its frame
+    std::shared_ptr<const MeshData> teapot =
+        MeshData::get("assets/teapot.obj", 10, BVH_Split::SAH);
+    mat_pointer teapot_mats[2] = {
+        std::make_shared<MaterialMetallic>(Vec3(.8, .8, .9), .2),
+        std::make_shared<MaterialDiffuse>(Vec3(.8, .3, .2))};
+    const int rows = 32;
+    for (int i = 0; i < rows * rows; i++) {
+        int x = i % rows, z = i / rows;
+        shapes.push_back(std::make_unique<MeshInstance>(
+            teapot, teapot_mats[(x + z) % 2],
+            Vec3(x - rows / 2 + 0.5f, 0, -1.5f - z), Vec3(.005, .005, .005),
+            Vec3(0, 2.39996f * i, 0)));
+    }
+
+    // setups the ground which a diffuse material rectangle consisting of
+    // two triangle shapes having a common side
+    mat_pointer ground_mat =
+        std::make_shared<MaterialDiffuse>(Vec3(.6, .6, .6));
+    shapes.push_back(std::make_unique<Triangle>(
+        Vec3(-20, 0, 5), Vec3(20, 0, -40), Vec3(20, 0, 5), ground_mat));
+    shapes.push_back(std::make_unique<Triangle>(
+        Vec3(-20, 0, 5), Vec3(-20, 0, -40), Vec3(20, 0, -40), ground_mat));
+
+    mat_pointer sun = std::make_shared<MaterialEmissive>(Vec3(1, .95, .85), 4);
+    obj_pointer sun_ball = std::make_unique<Sphere>(Vec3(0, 0, 0), 10, sun);
+    sun_ball->frame.origin = Vec3(10, 30, -10);
+    sun_ball->frame.lockFrame();
+    shapes.push_back(std::move(sun_ball));
+}
+
 void generate_scene(Camera& cam, std::vector<obj_pointer> &shapes, Scene scene)
 {
     if (scene == Scene::CORNELL)
@@ -546,5 +580,10 @@ void generate_scene(Camera& cam, std::vector<obj_pointer> &shapes, Scene scene)
         cam.look_at(Vec3(0, 0.3, -0.1), Vec3(0, 0, -3));
         generate_scene4(shapes);
     }
+    else if (scene == Scene::TEAPOT_FIELD)
+    {
+        cam.look_at(Vec3(0, 1.5, 1.5), Vec3(0, 0, -6));
+        generate_scene5(shapes);
+    }
     std::cout << "[Tinge] Scene Generation complete" << std::endl;
 }
@@ -8,7 +8,8 @@ enum struct Scene
     CORNELL,
     TEAPOT,
     MONKEY,
-    COLOR_BOX
+    COLOR_BOX,
+    TEAPOT_FIELD
 };
 
 void generate_scene(Camera& cam, std::vector<obj_pointer> &shapes, Scene kind);
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TINGE_SSE
+#include <emmintrin.h>
+#endif
+
+/***********************************
+ * Lane mask for four packed floats
+ ***********************************/
+struct Mask4 {
+#ifdef TINGE_SSE
+    __m128 m; /**< All bits set in lanes that are true*/
+
+    Mask4() {}
+    Mask4(__m128 m) : m(m) {}
+
+    /***************************************************
+     * @brief Packs the lanes into the low four bits of an int
+     ***************************************************/
+    inline int bits() const { return _mm_movemask_ps(m); }
+#else
+    bool m[4]; /**< Lane values*/
+
+    inline int bits() const {
+        return (m[0] ? 1 : 0) | (m[1] ? 2 : 0) | (m[2] ? 4 : 0) |
+               (m[3] ? 8 : 0);
+    }
+#endif
+};
+
+/***********************************
+ * Four packed floats, kept in an SSE register when available
+ ***********************************/
+struct Float4 {
+#ifdef TINGE_SSE
+    __m128 v; /**< Packed lanes*/
+
+    Float4() {}
+    Float4(__m128 v) : v(v) {}
+    explicit Float4(float f) : v(_mm_set1_ps(f)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    /***************************************************
+     * @brief Reads a single lane
+     ***************************************************/
+    inline float operator[](int i) const {
+        alignas(16) float f[4];
+        _mm_store_ps(f, v);
+        return f[i];
+    }
+#else
+    float v[4]; /**< Lanes*/
+
+    Float4() {}
+    explicit Float4(float f) : v{f, f, f, f} {}
+    Float4(float a, float b, float c, float d) : v{a, b, c, d} {}
+
+    inline float operator[](int i) const { return v[i]; }
+#endif
+};
+
+#ifdef TINGE_SSE
+
+inline Float4 operator+(const Float4 &a, const Float4 &b) {
+    return _mm_add_ps(a.v, b.v);
+}
+inline Float4 operator-(const Float4 &a, const Float4 &b) {
+    return _mm_sub_ps(a.v, b.v);
+}
+inline Float4 operator*(const Float4 &a, const Float4 &b) {
+    return _mm_mul_ps(a.v, b.v);
+}
+inline Float4 operator/(const Float4 &a, const Float4 &b) {
+    return _mm_div_ps(a.v, b.v);
+}
+inline Float4 f4_min(const Float4 &a, const Float4 &b) {
+    return _mm_min_ps(a.v, b.v);
+}
+inline Float4 f4_max(const Float4 &a, const Float4 &b) {
+    return _mm_max_ps(a.v, b.v);
+}
+inline Mask4 operator<(const Float4 &a, const Float4 &b) {
+    return _mm_cmplt_ps(a.v, b.v);
+}
+inline Mask4 operator>(const Float4 &a, const Float4 &b) {
+    return _mm_cmpgt_ps(a.v, b.v);
+}
+inline Mask4 operator<=(const Float4 &a, const Float4 &b) {
+    return _mm_cmple_ps(a.v, b.v);
+}
+inline Mask4 operator>=(const Float4 &a, const Float4 &b) {
+    return _mm_cmpge_ps(a.v, b.v);
+}
+inline Mask4 operator!=(const Float4 &a, const Float4 &b) {
+    return _mm_cmpneq_ps(a.v, b.v);
+}
+inline Mask4 operator&(const Mask4 &a, const Mask4 &b) {
+    return _mm_and_ps(a.m, b.m);
+}
+inline Mask4 operator|(const Mask4 &a, const Mask4 &b) {
+    return _mm_or_ps(a.m, b.m);
+}
+
+/***************************************************
+ * @brief Mask from the low four bits of an int
+ ***************************************************/
+inline Mask4 mask_from_bits(int bits) {
+    __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i set = _mm_and_si128(_mm_set1_epi32(bits), lanes);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(set, lanes));
+}
+
+/***************************************************
+ * @brief Picks a where the mask is set and b elsewhere
+ ***************************************************/
+inline Float4 select(const Mask4 &mask, const Float4 &a, const Float4 &b) {
+    return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+
+inline Float4 f4_abs(const Float4 &a) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v);
+}
+
+/***************************************************
+ * @brief Loads four floats from a 16 byte aligned address
+ ***************************************************/
+inline Float4 f4_load(const float *p) { return _mm_load_ps(p); }
+
+/***************************************************
+ * @brief Stores four floats to a 16 byte aligned address
+ ***************************************************/
+inline void f4_store(float *p, const Float4 &a) { _mm_store_ps(p, a.v); }
+
+/***************************************************
+ * @brief Loads four floats from any address
+ ***************************************************/
+inline Float4 f4_loadu(const float *p) { return _mm_loadu_ps(p); }
+
+/***************************************************
+ * @brief Stores four floats to any address
+ ***************************************************/
+inline void f4_storeu(float *p, const Float4 &a) { _mm_storeu_ps(p, a.v); }
+
+/***************************************************
+ * @brief Truncates the lanes to ints and stores them to any address
+ ***************************************************/
+inline void f4_store_int(int *p, const Float4 &a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm_cvttps_epi32(a.v));
+}
+
+#else
+
+#define TINGE_F4_OP(name, expr)                                                \
+    inline Float4 name(const Float4 &a, const Float4 &b) {                     \
+        Float4 r;                                                              \
+        for (int i = 0; i < 4; i++)                                            \
+            r.v[i] = expr;                                                     \
+        return r;                                                              \
+    }
+#define TINGE_M4_OP(name, expr)                                                \
+    inline Mask4 name(const Float4 &a, const Float4 &b) {                      \
+        Mask4 r;                                                               \
+        for (int i = 0; i < 4; i++)                                            \
+            r.m[i] = expr;                                                     \
+        return r;                                                              \
+    }
+
+TINGE_F4_OP(operator+, a.v[i] + b.v[i])
+TINGE_F4_OP(operator-, a.v[i] - b.v[i])
+TINGE_F4_OP(operator*, a.v[i] * b.v[i])
+TINGE_F4_OP(operator/, a.v[i] / b.v[i])
+TINGE_F4_OP(f4_min, b.v[i] < a.v[i] ? b.v[i] : a.v[i])
+TINGE_F4_OP(f4_max, b.v[i] > a.v[i] ? b.v[i] : a.v[i])
+TINGE_M4_OP(operator<, a.v[i] < b.v[i])
+TINGE_M4_OP(operator>, a.v[i] > b.v[i])
+TINGE_M4_OP(operator<=, a.v[i] <= b.v[i])
+TINGE_M4_OP(operator>=, a.v[i] >= b.v[i])
+TINGE_M4_OP(operator!=, a.v[i] != b.v[i])
+
+#undef TINGE_F4_OP
+#undef TINGE_M4_OP
+
+inline Mask4 operator&(const Mask4 &a, const Mask4 &b) {
+    Mask4 r;
+    for (int i = 0; i < 4; i++)
+        r.m[i] = a.m[i] && b.m[i];
+    return r;
+}
+inline Mask4 operator|(const Mask4 &a, const Mask4 &b) {
+    Mask4 r;
+    for (int i = 0; i < 4; i++)
+        r.m[i] = a.m[i] || b.m[i];
+    return r;
+}
+inline Mask4 mask_from_bits(int bits) {
+    Mask4 r;
+    for (int i = 0; i < 4; i++)
+        r.m[i] = (bits >> i) & 1;
+    return r;
+}
+inline Float4 select(const Mask4 &mask, const Float4 &a, const Float4 &b) {
+    Float4 r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = mask.m[i] ? a.v[i] : b.v[i];
+    return r;
+}
+inline Float4 f4_abs(const Float4 &a) {
+    Float4 r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = std::fabs(a.v[i]);
+    return r;
+}
+inline Float4 f4_load(const float *p) { return Float4(p[0], p[1], p[2], p[3]); }
+inline void f4_store(float *p, const Float4 &a) {
+    for (int i = 0; i < 4; i++)
+        p[i] = a.v[i];
+}
+inline Float4 f4_loadu(const float *p) { return f4_load(p); }
+inline void f4_storeu(float *p, const Float4 &a) { f4_store(p, a); }
+inline void f4_store_int(int *p, const Float4 &a) {
+    for (int i = 0; i < 4; i++)
+        p[i] = int(a.v[i]);
+}
+
+#endif
@@ -29,6 +29,13 @@ inline static Vec4 mix(const Vec4 &v1, const Vec4 &v2, float t) {
     return v1 * (1 - t) + v2 * t;
 }
 
+/*********************************************
+ * @brief Returns the Rec. 709 luminance of a linear RGB colour
+ *********************************************/
+inline static float luminance(const Vec3 &c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
 /**************************************************
  * @brief Returns v clamped to the range [v_min, v_max]
  * @param v The value to be clamped